@@ -5,6 +5,15 @@
  */
 
 #include <AberLED.h>
+#include <AberLEDLink.h>
+
+// Set this to 1 to record each session to Serial (its random seed and the
+// buttons pressed in every frame), or to 2 to wait for a recording to come in
+// on Serial and play it back as fast as possible. All the game's timers use
+// AberLED.getFrameTime() rather than millis(), so a replay is exact.
+#ifndef RECORDMODE
+#define RECORDMODE 0
+#endif
 
 // invalid state to which we initialise the state variable
 #define S_INVALID -1 
@@ -17,78 +26,196 @@
 // the player has lost their last life
 #define S_END 3
 
+// the games, chosen on the start screen: FIRE for the wall shooter, UP for
+// Tetris, DOWN for the wall shooter against another board (see "Versus mode"
+// below). They all use the same states and lives.
+#define G_WALL 0
+#define G_TETRIS 1
+int game = G_WALL;
+
+// trace record ids, for AberLED.trace() - AberLED/extras/tracedecode.py
+// knows these
+#define T_STATE 1      // changed state, the argument is the new state
+#define T_BADSTATE 2   // bad state, the argument says where it was found
+#define T_LINES 3      // Tetris lines cleared, the argument is the total so far
+#define T_VERSUSEND 4  // a versus match was abandoned, the argument says why
+// where a bad state was found
+#define BAD_INPUT 0
+#define BAD_UPDATE 1
+#define BAD_RENDER 2
+
 // the state variable - starts out invalid
 int state = S_INVALID;
-// the time the current state was entered
+// the time the current state was entered (from gameTime())
 unsigned long stateStartTime;
 
+unsigned long gameTime();
+void startTasks();
+
 // always change state by calling this function, never
 // set the state variable directly
 void gotoState(int s) {
-    Serial.print("Going to state "); // handy for debugging!
-    Serial.println(s);
+    AberLED.trace(T_STATE, s); // handy for debugging!
     state = s;
-    stateStartTime=millis();
+    stateStartTime=gameTime();
+    startTasks(); // each state has its own timers
 }   
 
 // get the time the system has been in the current state
 unsigned long getStateTime(){
-    return millis()-stateStartTime;
+    return gameTime()-stateStartTime;
+}
+
+// the colour of the box in the End state: red, or in versus mode green if we
+// won and yellow for a draw
+int endColour = RED;
+
+// the buttons which went down for each player in this frame (or in versus
+// mode this step), with button b on bit b-1 - see handleInput()
+uint8_t pressed[2];
+// and whether the model can move on this frame - always, except in versus
+// mode while we wait for the other board
+bool stepReady;
+
+bool buttonDown(int player, int b){
+    return pressed[player] & (1 << (b - 1));
+}
+
+// the buttons which went down in the last frame, in a mask like pressed[]
+uint8_t readButtons(){
+    const int buttons[5] = {UP, DOWN, LEFT, RIGHT, FIRE};
+    uint8_t mask = 0;
+    for(int i=0;i<5;i++){
+        if(AberLED.getButtonDown(buttons[i]))
+            mask |= 1 << (buttons[i] - 1);
+    }
+    return mask;
+}
+
+
+/**************************************************************************
+ * 
+ * Random numbers
+ * 
+ **************************************************************************/
+
+// This is a xorshift generator, which is much quicker than random() - that
+// does two 32-bit divisions every time, and we need a modulo on top. We take
+// a byte of each 32-bit number for every random bit we need, comparing it
+// with a threshold worked out by the compiler.
+
+uint32_t rngState = 1;
+
+// the threshold for a byte giving a probability of n/d
+#define RANDOM_THRESHOLD(n,d) ((uint8_t)((256UL*(n) + (d)/2) / (d)))
+
+// seed the generator (0 would get stuck, so it's not allowed)
+void seedRandom(uint32_t seed){
+    rngState = seed ? seed : 1;
+}
+
+// get the next 32 random bits
+uint32_t nextRandom(){
+    uint32_t x = rngState;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return rngState = x;
+}
+
+// get 8 random bits, each set with probability threshold/256, from two draws
+uint8_t randomMask8(uint8_t threshold){
+    uint8_t mask = 0;
+    for(int draw=0;draw<2;draw++){
+        uint32_t r = nextRandom();
+        for(int i=0;i<4;i++){
+            mask = (mask << 1) | ((uint8_t)r < threshold);
+            r >>= 8;
+        }
+    }
+    return mask;
 }
 
+// spread the 8 bits of b out so each one is in the lower bit of a 2-bit
+// cell, as in an AberLED row - so 1 bits become GREEN, or RED if shifted up
+uint16_t spreadBits(uint8_t b){
+    uint16_t v = b;
+    v = (v | (v << 4)) & 0x0f0f;
+    v = (v | (v << 2)) & 0x3333;
+    v = (v | (v << 1)) & 0x5555;
+    return v;
+}
 
 /**************************************************************************
  * 
  * The player model and its code
  * 
  **************************************************************************/
-/*
 
-int playerX;   // player X position
-int playerLives; // number of lives remaining
+// There is one player, number 0 - except in versus mode, where there are
+// two, and this board's player is number me.
+#define MAXPLAYERS 2
+int numPlayers = 1;
+int me = 0;
+
+int playerX[MAXPLAYERS];   // player X position
+int playerLives[MAXPLAYERS]; // number of lives remaining
 
 // initialise the player model
 void initPlayer(){
-    playerX = 4;
-    playerLives = 3;
+    for(int p=0;p<MAXPLAYERS;p++){
+        playerX[p] = numPlayers == 1 ? 4 : 2 + p * 3;
+        playerLives[p] = 3;
+    }
 }
 
-// removes a life from the player,
+// removes a life from a player,
 // returns true if the player is now dead
-bool removePlayerLife(){
-    playerLives--;
-    return playerLives == 0;
+bool removePlayerLife(int p){
+    playerLives[p]--;
+    return playerLives[p] == 0;
 }
 
 // player movement routines, limiting the motion to the screen
-void movePlayerLeft() {
-    if(playerX>0)
-        playerX--;
+void movePlayerLeft(int p) {
+    if(playerX[p]>0)
+        playerX[p]--;
 }
 
-void movePlayerRight() {
-    if(playerX<7)
-        playerX++;
+void movePlayerRight(int p) {
+    if(playerX[p]<7)
+        playerX[p]++;
 }
-*/
 
 
-// draw the player (must be between clear()/swap())
+// draw the players (must be between clear()/swap()) - ours in green, and
+// in versus mode the other board's in yellow
 void renderPlayer() {
-    AberLED.set(playerX,7,GREEN);
+    for(int p=0;p<numPlayers;p++){
+        if(p != me)
+            AberLED.setFast(playerX[p],7,YELLOW);
+    }
+    AberLED.setFast(playerX[me],7,GREEN);
 }
 
-// render lives in the LiveLost state as 3 lights
-void renderLives(){
-    AberLED.set(2,4,GREEN); // left dot always green
-    if(playerLives>1) // middle dot green if lives>1
-        AberLED.set(3,4,GREEN);
+// render a player's lives as 3 lights on row y
+void renderLivesRow(int p, int y){
+    AberLED.setFast(2,y,GREEN); // left dot always green
+    if(playerLives[p]>1) // middle dot green if lives>1
+        AberLED.setFast(3,y,GREEN);
     else
-        AberLED.set(3,4,RED);
-    if(playerLives>2) // right dot green if lives>2
-        AberLED.set(4,4,GREEN);
+        AberLED.setFast(3,y,RED);
+    if(playerLives[p]>2) // right dot green if lives>2
+        AberLED.setFast(4,y,GREEN);
     else
-        AberLED.set(4,4,RED);
+        AberLED.setFast(4,y,RED);
+}
+
+// render lives in the LiveLost state - ours, and the other board's above
+void renderLives(){
+    renderLivesRow(me, 4);
+    if(numPlayers > 1)
+        renderLivesRow(1 - me, 2);
 }
 
 /**************************************************************************
@@ -97,48 +224,88 @@ void renderLives(){
  * 
  **************************************************************************/
 
-// wall blocks are in an 8x8 array.
+// wall blocks are stored packed into rows of 16 bits, with 2 bits
+// per block - the same layout as the AberLED buffers.
 // 0 means no block present,
-// 1 means 1 hit left, 2 means 2 hits left.
-// less than zero means an unbreakable block.
-int blocks[8][8];
+// 1 means 1 hit left, 2 means 2 hits left,
+// 3 means an unbreakable block.
+// The rows are a circular buffer: wallTop is the index of the top
+// row, so scrolling just moves wallTop rather than copying rows.
+#define WALLHEIGHT 8
+uint16_t wall[WALLHEIGHT];
+int wallTop = 0;
 
+#define BLOCK_EMPTY 0
+#define BLOCK_NEW 2
+#define BLOCK_UNBREAKABLE 3
 
-// scrolling timer
+// the chance of a new block being unbreakable (1 in 10), and of a block
+// next to a destroyed one being damaged (2 in 3)
+#define UNBREAKABLE_THRESHOLD RANDOM_THRESHOLD(1,10)
+#define DAMAGE_THRESHOLD RANDOM_THRESHOLD(2,3)
+
+// scrolling interval in milliseconds
 #define SCROLLINTERVAL 1000 // put this line with the rest of the wall model
-unsigned long lastScrollTime=0;
 
-// create a new block at x,y
-void createNewBlock(int x,int y,bool unbreakable){
-    if(unbreakable)
-        blocks[x][y]=-1;
-    else
-        blocks[x][y]=2;
+// get the row y down from the top of the wall
+uint16_t &wallRow(int y){
+    return wall[(wallTop + y) % WALLHEIGHT];
+}
+
+// get the block at x,y
+int getBlock(int x,int y){
+    return (wallRow(y) >> (x*2)) & 3;
+}
+
+// set the block at x,y
+void setBlock(int x,int y,int b){
+    uint16_t &row = wallRow(y);
+    row = (row & ~(3u << (x*2))) | ((uint16_t)b << (x*2));
+}
+
+// get a mask of the occupied blocks in a row: the lower bit of
+// each block's pair is set if there is anything there.
+uint16_t getOccupiedBlocks(int y){
+    uint16_t row = wallRow(y);
+    return (row | (row >> 1)) & 0x5555;
 }
 
-// scroll all blocks downwards
+// damage the block at x,y, which must not be empty. Returns
+// true if the block has been destroyed.
+bool damageBlock(int x,int y){
+    int b = getBlock(x,y);
+    if(b==BLOCK_UNBREAKABLE)
+        return false;
+    setBlock(x,y,b-1);
+    return b==1;
+}
+
+// scroll all blocks downwards. The bottom row drops off and becomes
+// the new top row, which createNewTopWallBlocks() must then fill.
 void scrollAllBlocks() {
-    for(int y=6;y>=0;y--){ // loop 6,5,4,3,2,1,0
-        for(int x=0;x<8;x++){
-            blocks[x][y+1] = blocks[x][y];
-        }
-    }
+    wallTop = (wallTop + WALLHEIGHT - 1) % WALLHEIGHT;
+    // the next frame is this one moved down, which a TFT can do in hardware
+    AberLED.scrollDown();
 }
 
 // damage the blocks around a block which has just been destroyed
 void damageSurroundingBlocks(int bx,int by){
+    // one bit for each of the 8 surrounding blocks, set if it's to be
+    // damaged (2 out of 3 chance)
+    uint8_t damage = randomMask8(DAMAGE_THRESHOLD);
+
     // for all blocks surrounding bx,by:
     for(int x=bx-1;x<=bx+1;x++){ // loop from bx-1 to bx+1
         for(int y=by-1;y<=by+1;y++){ // loop from by-1 to by+1
-            // if the block is on screen
-            if(x>=0 && x<8 && y>=0 && y<8){
-                // if the block is not empty and a random
-                // number from 0,1 or 2 is not 0
-                // (i.e. 2 out of 3 chance)
-                if(blocks[x][y]!=0 && random(3)!=0)
-                    // damage the block
-                    blocks[x][y]--; 
-            }
+            if(x==bx && y==by) // the destroyed block itself
+                continue;
+            bool hit = damage & 1;
+            damage >>= 1;
+            // if the block is on screen, not empty and chosen
+            if(hit && x>=0 && x<8 && y>=0 && y<WALLHEIGHT &&
+               getBlock(x,y)!=BLOCK_EMPTY)
+                // damage the block
+                damageBlock(x,y);
         }
     }
 }
@@ -147,13 +314,11 @@ void damageSurroundingBlocks(int bx,int by){
 // hit any block at x,y with a bullet - returns true 
 // if a hit occurred
 bool checkBlocksForBullet(int x,int y) {  // x,y are bullet coords
-    if(blocks[x][y]!=0){ // only do something if a block is there
+    if(getBlock(x,y)!=BLOCK_EMPTY){ // only do something if a block is there
 
-        // decrement the hit count
-        blocks[x][y]--; 
-        
-        // damage surrounding blocks if this block was destroyed
-        if(blocks[x][y]==0)
+        // damage the block, and the surrounding blocks
+        // if this block was destroyed
+        if(damageBlock(x,y))
             damageSurroundingBlocks(x,y);
         
         // and return true, which tells the calling function
@@ -166,62 +331,58 @@ bool checkBlocksForBullet(int x,int y) {  // x,y are bullet coords
     return false;
 }
 
-// return true if the player has been hit
-bool hasPlayerBeenHit() {
+// return true if a player has been hit
+bool hasPlayerBeenHit(int p) {
 
     // return whether the block at the player's
-    // position is not empty - i.e. not 0
+    // position is not empty
 
-    return blocks[playerX][7]!=0;
+    return getOccupiedBlocks(7) & (1u << (playerX[p]*2));
 }
 
+// the new top row less the one it replaced, and the time it was made - see
+// the versus mode, which uses it to check the two boards agree
+uint16_t newRowDelta;
+unsigned long newRowTime = 0;
+
 // create a new row of blocks at the top of the screen - will
 // overwrite anything there
 void createNewTopWallBlocks() {
+    // which blocks are unbreakable (1 in 10 of them), with each bit
+    // spread out into the lower bit of its block
+    uint16_t unbreakable = spreadBits(randomMask8(UNBREAKABLE_THRESHOLD));
 
-    // for each square at the top
-
-    for(int x=0;x<8;x++) {
-
-        // make the block --- but 1 in 10 times
-        // make it unbreakable
-
-        if(random(10)==0)
-            createNewBlock(x,0,true);
-        else
-            createNewBlock(x,0,false);
-    }
+    // every block is new (binary 10), and the unbreakable ones
+    // also have the lower bit set (binary 11)
+    uint16_t row = BLOCK_NEW * 0x5555u | unbreakable;
+    newRowDelta = row ^ wallRow(1);
+    newRowTime = gameTime();
+    wallRow(0) = row;
 }   
 
 // draw the blocks
 void renderBlocks() {
 
-    // AberLED.clear() must have been called before
-
-    for(int x=0;x<8;x++){ // for all locations
-        for(int y=0;y<8;y++) {
-            switch(blocks[x][y]) { // look at the block type here
-                case 0:  // don't draw anything, the location is empty
-                    break;
-                case 1:  // case 1 falls through...
-                case 2:  // ...into case 2, so both will draw as red
-                    AberLED.set(x,y,RED);
-                    break;
-                default: // anything else must be yellow
-                    AberLED.set(x,y,YELLOW);
-            }
-        }
+    // this writes whole rows, so it must be drawn before anything else
+
+    for(int y=0;y<8;y++){
+        // breakable blocks (1 or 2) are red, unbreakable blocks (3) are
+        // yellow, so the red bit is set for any block and the green bit
+        // only for the unbreakable ones - where both bits are set.
+        uint16_t row = wallRow(y);
+        uint16_t occupied = getOccupiedBlocks(y);
+        uint16_t unbreakable = row & (row >> 1) & 0x5555;
+        AberLED.setRow(y, (occupied << 1) | unbreakable);
     }
     // AberLED.swap() must be called later
 }
 
 // initialise the blocks - there will no blocks on the screen
 void initBlocks() {
-    for(int x=0;x<8;x++){ // for all locations
-        for(int y=0;y<8;y++) {
-            blocks[x][y]=0;
-        }
+    for(int y=0;y<WALLHEIGHT;y++){
+        wall[y]=0;
     }
+    wallTop = 0;
 }
 
 /**************************************************************************
@@ -230,70 +391,590 @@ void initBlocks() {
  * 
  **************************************************************************/
 
-// change this to change the number of bullets
+// change this to change the number of bullets (up to 32)
 #define MAXBULLETS 4
 
+// The bullets are a pool: bit i of bulletsActive is set if bullet i is in
+// flight, so finding a free one is finding the lowest clear bit, and the
+// loops below only visit the bullets which are in flight - however many
+// slots there are.
+#if MAXBULLETS <= 8
+typedef uint8_t BulletMask;
+#elif MAXBULLETS <= 16
+typedef uint16_t BulletMask;
+#else
+typedef uint32_t BulletMask;
+#endif
+#define ALLBULLETS ((BulletMask)(((uint32_t)1 << (MAXBULLETS - 1)) * 2 - 1))
+
+BulletMask bulletsActive;
+
 // position of the bullets if they are active
-int bulletX[MAXBULLETS];
-int bulletY[MAXBULLETS];
+int8_t bulletX[MAXBULLETS];
+int8_t bulletY[MAXBULLETS];
 
 // bullet update interval in milliseconds
 #define BULLETINTERVAL 100
-// bullet timer variable
-unsigned long lastBulletUpdateTime=0;
 
-
-
-// which bullets are active (in flight)
-bool isBulletActive[MAXBULLETS];
+// the number of the lowest set bit of m, which mustn't be 0
+inline uint8_t lowestBullet(BulletMask m){
+    return sizeof(m) > sizeof(unsigned) ? __builtin_ctzl(m) : __builtin_ctz(m);
+}
 
 // make all bullets inactive
 void initBullets() {
-    for(int i=0;i<MAXBULLETS;i++) {
-        isBulletActive[i]=false;
-    }
+    bulletsActive = 0;
 }
 
-// try to fire a bullet, will do nothing if MAXBULLETS bullets
-// are already in flight
-void fireBullet() {
+// try to fire a bullet from a player, will do nothing if MAXBULLETS
+// bullets are already in flight
+void fireBullet(int p) {
     // find a spare (inactive) bullet
-    for(int i=0;i<MAXBULLETS;i++) {
-        if(!isBulletActive[i]) { // if bullet i is not active
-            isBulletActive[i] = true; // make it active
-            bulletX[i] = playerX; // set to player position
-            bulletY[i] = 7; // on the bottom row
-            return; // return early from function
-        }
-    }
-    // if we got this far we were unable to fire. Not an
-    // error, it just happens sometimes that we've fired
-    // too many.
+    BulletMask spare = ~bulletsActive & ALLBULLETS;
+    // if there isn't one we are unable to fire. Not an error, it
+    // just happens sometimes that we've fired too many.
+    if(!spare)
+        return;
+    uint8_t i = lowestBullet(spare);
+    bulletsActive |= (BulletMask)1 << i; // make it active
+    bulletX[i] = playerX[p]; // set to player position
+    bulletY[i] = 7; // on the bottom row
 }
 
 // draw the bullets
 void renderBullets() {
-    for(int i=0;i<MAXBULLETS;i++) {
-        if(isBulletActive[i])
-            AberLED.set(bulletX[i],bulletY[i],GREEN);
+    for(BulletMask m=bulletsActive;m;m&=m-1) {
+        uint8_t i = lowestBullet(m);
+        AberLED.setFast(bulletX[i],bulletY[i],GREEN);
     }
 }
 
 // move all bullets and check them for collisions with blocks,
 // deactivating them if there was a collision
 void updateBullets() {
-    for(int i=0;i<MAXBULLETS;i++) {
-        if(isBulletActive[i]) { // only update active bullets
-            // first check the wall blocks for the bullet, and
-            // deactivate the bullet if it hit one.
-            if(checkBlocksForBullet(bulletX[i],bulletY[i]))
-                isBulletActive[i]=false;
-            // move the bullet up one square
-            bulletY[i]--;
-            // and deactivate if it's off screen
-            if(bulletY[i]<0)
-                isBulletActive[i]=false;
+    for(BulletMask m=bulletsActive;m;m&=m-1) { // only update active bullets
+        uint8_t i = lowestBullet(m);
+        int8_t x = bulletX[i], y = bulletY[i];
+        // first check the wall for a block where the bullet is - one
+        // bit test in the row's occupancy mask - and only if there is
+        // one, hit it and deactivate the bullet.
+        if((getOccupiedBlocks(y) & (1u << (x*2))) && checkBlocksForBullet(x,y))
+            bulletsActive &= ~((BulletMask)1 << i);
+        // move the bullet up one square, and deactivate it if it's
+        // off screen
+        else if(--bulletY[i] < 0)
+            bulletsActive &= ~((BulletMask)1 << i);
+    }
+}
+
+/**************************************************************************
+ * 
+ * The Tetris model and its code
+ * 
+ **************************************************************************/
+
+// The playfield is the whole 8x8 display, one byte per row with bit x set
+// if there is a block in column x. Each rotation of each piece is a 4x4
+// bitmask - bits 0-3 are its top row, bits 4-7 the next, and so on, with
+// bit 0 of each row the left column - so testing a piece against the field
+// is just shifting and ANDing four rows.
+
+#define FIELDHEIGHT 8
+#define FULLROW 0xff
+uint8_t field[FIELDHEIGHT];
+
+// rotate an n x n piece (in the top left of its 4x4 mask) a quarter turn
+// clockwise, a bit at a time: (row, col) goes to (col, n-1-row)
+constexpr uint16_t turnShapeBit(uint16_t m, uint8_t n, uint8_t i){
+    return ((m >> i) & 1) ? 1u << ((i % 4) * 4 + n - 1 - i / 4) : 0;
+}
+constexpr uint16_t turnShape(uint16_t m, uint8_t n, uint8_t i = 0){
+    return i == 16 ? 0 : turnShapeBit(m, n, i) | turnShape(m, n, i + 1);
+}
+#define ROTATIONS(m, n) { m, turnShape(m, n), \
+        turnShape(turnShape(m, n), n), \
+        turnShape(turnShape(turnShape(m, n), n), n) }
+
+// the pieces in their starting rotation, drawn with the left column on
+// the left (although it's the lowest bit), and the size of the square
+// each one turns in. The compiler works out the other rotations.
+#define NUMPIECES 7
+const uint16_t pieces[NUMPIECES][4] PROGMEM = {
+    ROTATIONS(0x00f0, 4), // ....  ####
+    ROTATIONS(0x0033, 2), // ##  ##
+    ROTATIONS(0x0072, 3), // .#.  ###
+    ROTATIONS(0x0036, 3), // .##  ##.
+    ROTATIONS(0x0063, 3), // ##.  .##
+    ROTATIONS(0x0071, 3), // #..  ###
+    ROTATIONS(0x0074, 3), // ..#  ###
+};
+
+// the falling piece: which one, its rotation, and where the top left of
+// its 4x4 mask is (x can go below 0, as some pieces have gaps on the left)
+uint8_t pieceType, pieceRotation;
+int8_t pieceX, pieceY;
+
+// the HUD fields showing the lives and the lines cleared
+#define HUD_LIVES 0
+#define HUD_LINES 1
+
+// lines cleared this game
+uint16_t linesCleared;
+
+uint16_t pieceShape(uint8_t type, uint8_t rotation){
+    return pgm_read_word(&pieces[type][rotation & 3]);
+}
+
+// row r of a shape, moved across to column x. Columns 0-7 of the field are
+// bits 4-11 of this, so anything outside those is off the edge.
+inline uint16_t shapeRow(uint16_t shape, uint8_t r, int8_t x){
+    return ((shape >> (r * 4)) & 0x0f) << (x + 4);
+}
+
+// does a shape at x,y overlap the blocks, the walls or the floor?
+bool pieceCollides(uint16_t shape, int8_t x, int8_t y){
+    for(uint8_t r=0;r<4;r++){
+        uint16_t bits = shapeRow(shape, r, x);
+        if(!bits)
+            continue;
+        int8_t fy = y + r;
+        if(fy >= FIELDHEIGHT)
+            return true;
+        // the walls either side, and what's in the field on this row
+        uint16_t solid = 0xf00f | (fy >= 0 ? (uint16_t)field[fy] << 4 : 0);
+        if(bits & solid)
+            return true;
+    }
+    return false;
+}
+
+// try to move (and turn) the piece, returning false if it won't fit
+bool movePiece(int8_t dx, int8_t dy, uint8_t turn = 0){
+    uint16_t shape = pieceShape(pieceType, pieceRotation + turn);
+    if(pieceCollides(shape, pieceX + dx, pieceY + dy))
+        return false;
+    pieceX += dx;
+    pieceY += dy;
+    pieceRotation = (pieceRotation + turn) & 3;
+    return true;
+}
+
+// turn the piece, nudging it sideways if it's against a wall or block
+void rotatePiece(){
+    if(!movePiece(0, 0, 1) && !movePiece(-1, 0, 1))
+        movePiece(1, 0, 1);
+}
+
+// start a new piece at the top, returning false if there's no room
+bool spawnPiece(){
+    pieceType = ((uint8_t)nextRandom() * NUMPIECES) >> 8;
+    pieceRotation = 0;
+    pieceX = 2;
+    pieceY = 0;
+    return !pieceCollides(pieceShape(pieceType, 0), pieceX, pieceY);
+}
+
+// remove any full rows, moving the ones above down - one pass from the
+// bottom up, copying each row which isn't full to where it now belongs
+void clearLines(){
+    int8_t dst = FIELDHEIGHT - 1;
+    for(int8_t src=FIELDHEIGHT-1;src>=0;src--){
+        if(field[src] != FULLROW)
+            field[dst--] = field[src];
+    }
+    if(dst < 0)
+        return; // nothing was full
+    linesCleared += dst + 1;
+    while(dst >= 0)
+        field[dst--] = 0;
+    AberLED.trace(T_LINES, linesCleared);
+}
+
+// add the piece to the field where it is, clear any lines it finished and
+// start the next one - returning false if that doesn't fit
+bool lockPiece(){
+    uint16_t shape = pieceShape(pieceType, pieceRotation);
+    for(uint8_t r=0;r<4;r++){
+        int8_t fy = pieceY + r;
+        if(fy >= 0 && fy < FIELDHEIGHT)
+            field[fy] |= shapeRow(shape, r, pieceX) >> 4;
+    }
+    clearLines();
+    return spawnPiece();
+}
+
+// the time between drops, which gets shorter as more lines are cleared
+unsigned long dropInterval(){
+    return linesCleared < 18 ? 600 - linesCleared * 25 : 150;
+}
+
+// drop the piece a row, locking it if it has landed - returns false if
+// the next piece couldn't start, which loses a life
+bool dropPiece(){
+    return movePiece(0, 1) || lockPiece();
+}
+
+// empty the field and start a piece
+void initField(){
+    for(int y=0;y<FIELDHEIGHT;y++)
+        field[y] = 0;
+    linesCleared = 0;
+    spawnPiece();
+}
+
+// draw the field in red and the piece in yellow (so with tiles it's a block,
+// not a ship), building whole rows and writing them all at once
+void renderField(){
+    uint16_t rows[FIELDHEIGHT];
+    for(int y=0;y<FIELDHEIGHT;y++)
+        rows[y] = spreadBits(field[y]) << 1;
+    uint16_t shape = pieceShape(pieceType, pieceRotation);
+    for(uint8_t r=0;r<4;r++){
+        int8_t fy = pieceY + r;
+        if(fy >= 0 && fy < FIELDHEIGHT)
+            rows[fy] |= spreadBits(shapeRow(shape, r, pieceX) >> 4) * YELLOW;
+    }
+    AberLED.blitRows(rows, 0, FIELDHEIGHT);
+}
+
+// the top of the field has been reached - lose a life
+void tetrisToppedOut(){
+    if(removePlayerLife(0))
+        gotoState(S_END);
+    else
+        gotoState(S_LIFELOST);
+}
+
+/**************************************************************************
+ * 
+ * Versus mode
+ * 
+ **************************************************************************/
+
+// Two boards play the wall game against each other, a ship each, with their
+// serial ports linked: each board's TX (pin 1) to the other's RX (pin 0), and
+// the grounds together. Press DOWN on the start screen of both; the start box
+// goes yellow until they find each other. The last ship standing wins.
+//
+// Each board runs the whole game, both ships and all, in lockstep: the model
+// moves on VERSUSSTEP ms at a time, and only once both boards' buttons for
+// that step are known. The boards agree on a random seed first, so they make
+// the same walls, and after that only the buttons cross the wire - 6 bytes a
+// step. A board sends its buttons for step n as soon as it has taken step
+// n-1, so they're normally there by the time the other board needs them and
+// the lockstep costs at most a frame. Each packet repeats the buttons for the
+// step before, in case that one was lost. Each new wall row goes along too,
+// as its difference from the row before it, to check that the boards haven't
+// drifted apart.
+//
+// Versus mode shares Serial with the trace log (the other board just skips
+// the records), but not with recording or replay.
+
+#define VERSUS (RECORDMODE == 0)
+
+#if VERSUS
+AberLEDLink versusLink(Serial);
+
+// packet types
+#define P_HELLO 1  // data: our nonce (2 bytes), and 1 if we've heard the other board
+#define P_STEP 2   // frame: the step. data: its buttons, with STEP_ROW set if a
+                   // row follows; the buttons for the step before; then the row
+                   // delta made in the step before, if there was one
+#define STEP_ROW 0x80
+
+#define VERSUSSTEP 40      // ms of game time in a step - about a TFT frame
+#define RESENDTIME 100     // how often to send again while we're kept waiting
+#define LINKTIMEOUT 3000   // give up if we've heard nothing for this long
+
+// why a match was abandoned, for T_VERSUSEND
+#define VE_LOST 0    // the other board stopped answering
+#define VE_DESYNC 1  // the boards made different walls
+
+bool linking = false;  // saying hello on the start screen
+bool versus = false;   // in a match
+
+// picked at random, to decide which board is player 0 and to make the seed
+uint16_t nonce, otherNonce;
+bool heardOther;
+
+// these are from AberLED.getFrameTime(), as they're about the real world
+unsigned long lastSendTime, lastHeardTime, nextStepTime;
+bool sendPending; // the last packet didn't fit in Serial's buffer
+
+unsigned long step;      // the step the model is about to take
+uint8_t pendingButtons;  // our buttons which have gone down since we last sent
+AberLEDPacket lastSent;  // our packet for this step
+
+// the other board's buttons for this step and the next, by step & 1
+uint8_t otherButtons[2];
+bool haveOther[2];
+
+// the row deltas made in a step, ours and the other board's, compared once
+// both are in
+unsigned long ownRowStep, otherRowStep;
+uint16_t ownRow, otherRow;
+bool ownRowSet, otherRowSet;
+#else
+const bool versus = false;
+#endif
+
+// the time the model goes by: the frame time, or in versus mode the steps
+// taken, so that the two boards agree exactly
+unsigned long gameTime(){
+#if VERSUS
+    if(versus)
+        return step * VERSUSSTEP;
+#endif
+    return AberLED.getFrameTime();
+}
+
+#if VERSUS
+void sendPacket(){
+    sendPending = !versusLink.send(lastSent);
+    if(!sendPending)
+        lastSendTime = AberLED.getFrameTime();
+}
+
+void sendHello(){
+    lastSent.type = P_HELLO;
+    lastSent.frame = 0;
+    lastSent.len = 3;
+    lastSent.data[0] = nonce;
+    lastSent.data[1] = nonce >> 8;
+    lastSent.data[2] = heardOther;
+    sendPacket();
+}
+
+// send the buttons pressed since the last step, which will be used for the
+// step we're now on
+void sendStep(){
+    uint8_t before = lastSent.data[0] & ~STEP_ROW;
+    lastSent.type = P_STEP;
+    lastSent.frame = step;
+    lastSent.data[0] = pendingButtons;
+    lastSent.data[1] = before;
+    lastSent.len = 2;
+    if(ownRowSet && ownRowStep + 1 == step){
+        lastSent.data[0] |= STEP_ROW;
+        lastSent.data[2] = ownRow;
+        lastSent.data[3] = ownRow >> 8;
+        lastSent.len = 4;
+    }
+    pendingButtons = 0;
+    sendPacket();
+}
+
+// start saying hello, on the start screen
+void startLinking(){
+    linking = true;
+    heardOther = false;
+    nonce = (uint16_t)micros() ^ (uint16_t)nextRandom();
+    sendHello();
+}
+
+void abandonVersus(int why){
+    AberLED.trace(T_VERSUSEND, why);
+    versus = false;
+    endColour = YELLOW;
+    gotoState(S_END);
+}
+
+void startVersus(){
+    linking = false;
+    versus = true;
+    numPlayers = 2;
+    // the board with the lower nonce is player 0, and the seed is both
+    // nonces in player order
+    me = nonce < otherNonce ? 0 : 1;
+    uint16_t n0 = me ? otherNonce : nonce, n1 = me ? nonce : otherNonce;
+    seedRandom((uint32_t)n0 << 16 | n1);
+
+    step = 0;
+    haveOther[0] = haveOther[1] = false;
+    ownRowSet = otherRowSet = false;
+    newRowTime = (unsigned long)-1;
+    pendingButtons = 0;
+    lastSent.data[0] = 0; // nothing was pressed in the step before the first
+    lastHeardTime = nextStepTime = AberLED.getFrameTime();
+
+    // everything in the model must start the same on both boards
+    game = G_WALL;
+    initPlayer();
+    initBlocks();
+    initBullets();
+    gotoState(S_PLAYING);
+    sendStep();
+}
+
+void storeOtherButtons(unsigned long s, uint8_t buttons){
+    if(!haveOther[s & 1]){
+        otherButtons[s & 1] = buttons;
+        haveOther[s & 1] = true;
+    }
+}
+
+void checkRows(){
+    if(ownRowSet && otherRowSet && ownRowStep == otherRowStep){
+        ownRowSet = otherRowSet = false;
+        if(ownRow != otherRow)
+            abandonVersus(VE_DESYNC);
+    }
+}
+
+// take a step packet from the other board
+void takeStep(const AberLEDPacket &p){
+    // is it for this step or the next? Anything else is an old one sent again.
+    uint8_t ahead = p.frame - (uint8_t)step;
+    if(ahead > 1)
+        return;
+    storeOtherButtons(step + ahead, p.data[0] & ~STEP_ROW);
+    if(ahead == 1)
+        storeOtherButtons(step, p.data[1]);
+    if((p.data[0] & STEP_ROW) && p.len == 4){
+        otherRow = p.data[2] | (uint16_t)p.data[3] << 8;
+        otherRowStep = step + ahead - 1;
+        otherRowSet = true;
+        checkRows();
+    }
+}
+
+// take in whatever the other board has sent
+void pollLink(){
+    AberLEDPacket p;
+    while(versusLink.receive(&p)){
+        lastHeardTime = AberLED.getFrameTime();
+        if(p.type == P_HELLO && p.len == 3 && linking){
+            otherNonce = p.data[0] | (uint16_t)p.data[1] << 8;
+            heardOther = true;
+            if(otherNonce == nonce){
+                // we can't tell who's who - both boards try again
+                startLinking();
+            } else if(p.data[2]) {
+                startVersus();
+            }
+        } else if(p.type == P_STEP && p.len >= 2){
+            // the other board has heard us and started, so we can too
+            if(linking && heardOther)
+                startVersus();
+            if(versus)
+                takeStep(p);
+        }
+    }
+}
+
+// in versus mode, see whether the next step can be taken, and if it can,
+// put both boards' buttons for it into pressed[]
+bool versusStepReady(){
+    pollLink();
+    if(!versus)
+        return false;
+    unsigned long now = AberLED.getFrameTime();
+    if(now - lastHeardTime > LINKTIMEOUT){
+        abandonVersus(VE_LOST);
+        return false;
+    }
+    if(!haveOther[step & 1] || (long)(now - nextStepTime) < 0){
+        if(sendPending || now - lastSendTime >= RESENDTIME)
+            sendPacket();
+        return false;
+    }
+    pressed[me] = lastSent.data[0] & ~STEP_ROW;
+    pressed[1 - me] = otherButtons[step & 1];
+    return true;
+}
+
+// after the model has taken a step, move on to the next and send our
+// buttons for it
+void finishStep(){
+    if(newRowTime == gameTime()){
+        ownRow = newRowDelta;
+        ownRowStep = step;
+        ownRowSet = true;
+    }
+    haveOther[step & 1] = false;
+    step++;
+    // keep to VERSUSSTEP, but if we've fallen well behind don't rush to
+    // catch up
+    nextStepTime += VERSUSSTEP;
+    if((long)(AberLED.getFrameTime() - nextStepTime) > VERSUSSTEP)
+        nextStepTime = AberLED.getFrameTime();
+    sendStep();
+    checkRows();
+    // the other board has ended the match at the same step
+    if(state == S_END)
+        versus = false;
+}
+#endif
+
+/**************************************************************************
+ * 
+ * The timers
+ * 
+ **************************************************************************/
+
+// Everything the model does on a timer is an AberLED task, run by
+// updateModel() on the gameTime() clock. Each state starts its own tasks
+// when it is entered, so a timer always counts from the start of the state.
+
+int bulletTask, wallTask, dropTask, lifeLostTask;
+
+// move the wall down and make a new top row
+void scrollWall(){
+    scrollAllBlocks();
+    createNewTopWallBlocks();
+}
+
+// the Tetris piece falls a row, faster as more lines are cleared
+void dropTick(){
+    if(dropPiece())
+        AberLED.setTaskPeriod(dropTask, dropInterval());
+    else
+        tetrisToppedOut();
+}
+
+// the player has dropped the piece, so the wait for the next fall starts again
+void dropByHand(){
+    if(dropPiece())
+        AberLED.startTask(dropTask, gameTime(), dropInterval());
+    else
+        tetrisToppedOut();
+}
+
+// after 2 seconds of LifeLost go back to Playing, clearing the screen of
+// blocks and bullets first
+void endLifeLost(){
+    if(game == G_TETRIS)
+        initField();
+    else {
+        initBlocks();
+        initBullets();
+    }
+    gotoState(S_PLAYING);
+}
+
+void addTasks(){
+    bulletTask = AberLED.addTask(updateBullets, BULLETINTERVAL);
+    wallTask = AberLED.addTask(scrollWall, SCROLLINTERVAL);
+    dropTask = AberLED.addTask(dropTick, dropInterval());
+    lifeLostTask = AberLED.addTask(endLifeLost, 2000);
+}
+
+// called by gotoState() to start the timers for the new state
+void startTasks(){
+    unsigned long now = gameTime();
+    AberLED.stopTasks();
+    switch(state){
+    case S_PLAYING:
+        if(game == G_TETRIS)
+            AberLED.startTask(dropTask, now, dropInterval());
+        else {
+            AberLED.startTask(bulletTask, now);
+            AberLED.startTask(wallTask, now);
         }
+        break;
+    case S_LIFELOST:
+        AberLED.startTask(lifeLostTask, now);
+        break;
     }
 }
 
@@ -310,8 +991,25 @@ void updateBullets() {
  */
 
 void setup(){
-    AberLED.begin();
-    Serial.begin(9600);
+    AberLED.begin(AF_TFTDISPLAY | AF_TILES);
+    Serial.begin(115200);
+    // on a TFT, show the lives and the Tetris lines above their labels
+    AberLED.addToText(F("Lives    Lines"));
+    AberLED.setHudField(HUD_LIVES, 4, 140, 5);
+    AberLED.setHudField(HUD_LINES, 58, 140, 5);
+    addTasks();
+#if RECORDMODE == 1
+    // pick a seed from the noise on an unconnected pin, and record it
+    uint16_t seed = analogRead(A5) ^ micros();
+    seedRandom(seed);
+    AberLED.startRecording(seed);
+#elif RECORDMODE == 2
+    seedRandom(AberLED.startReplay(Serial));
+#else
+    // always the same game, unless randomSeed() has been called (which
+    // the host build's -s option does)
+    seedRandom(random(0x7fffffffL));
+#endif
     gotoState(S_START);  // start in the Start state
     initPlayer();
     initBlocks();
@@ -324,25 +1022,87 @@ void setup(){
  */
 
 void handleInput(){
+    uint8_t local = readButtons();
+#if VERSUS
+    if(versus){
+        // these go to the other board with our buttons for the next step
+        pendingButtons |= local;
+        stepReady = versusStepReady();
+        if(!stepReady)
+            return;
+    } else
+#endif
+    {
+        pressed[0] = local;
+        stepReady = true;
+    }
+
     switch(state){
     case S_START:
+#if VERSUS
+        if(linking){
+            pollLink();
+            if(state != S_START)
+                break; // the other board answered, and we're away
+            if(AberLED.getFrameTime() - lastSendTime >= RESENDTIME)
+                sendHello();
+        }
+#endif
         // on FIRE, restart the game by reinitialising the model
-        // and going into the playing state.
-        if(AberLED.getButtonDown(FIRE)){
+        // and going into the playing state - or UP for Tetris, or
+        // DOWN to look for another board to play against.
+        if(buttonDown(0, FIRE)){
+            game = G_WALL;
+            numPlayers = 1;
+            me = 0;
             initPlayer();
             initBlocks();
             initBullets();
+            endColour = RED;
+            gotoState(S_PLAYING);
+        } else if(buttonDown(0, UP)){
+            game = G_TETRIS;
+            numPlayers = 1;
+            me = 0;
+            initPlayer();
+            initField();
+            endColour = RED;
             gotoState(S_PLAYING);
-        }   
+        }
+#if VERSUS
+        else if(buttonDown(0, DOWN) && !linking)
+            startLinking();
+        if(state != S_START)
+            linking = false;
+#endif
         break;
     case S_PLAYING:
-        // handle move/fire buttons
-        if(AberLED.getButtonDown(LEFT))
-            movePlayerLeft();
-        if(AberLED.getButtonDown(RIGHT))
-            movePlayerRight();
-        if(AberLED.getButtonDown(FIRE))
-            fireBullet();
+        if(game == G_TETRIS){
+            // move, turn and drop the piece
+            if(AberLED.getButtonDown(LEFT))
+                movePiece(-1, 0);
+            if(AberLED.getButtonDown(RIGHT))
+                movePiece(1, 0);
+            if(AberLED.getButtonDown(UP))
+                rotatePiece();
+            if(AberLED.getButtonDown(DOWN))
+                dropByHand();
+            if(AberLED.getButtonDown(FIRE)){
+                // drop all the way
+                while(movePiece(0, 1)) {}
+                dropByHand();
+            }
+            break;
+        }
+        // handle move/fire buttons, for each player
+        for(int p=0;p<numPlayers;p++){
+            if(buttonDown(p, LEFT))
+                movePlayerLeft(p);
+            if(buttonDown(p, RIGHT))
+                movePlayerRight(p);
+            if(buttonDown(p, FIRE))
+                fireBullet(p);
+        }
         break;
     case S_LIFELOST:
         break;
@@ -352,80 +1112,97 @@ void handleInput(){
             gotoState(S_START);
         break;
     default:
-        Serial.println("Bad state in handleInput");
+        AberLED.trace(T_BADSTATE, BAD_INPUT);
         break;
     }
 }
 
-// if the player has been hit, deduct a life and go to either
+// if a player has been hit, deduct a life and go to either
 // the End or LifeLost state.
 void checkPlayerHit(){
-    if(hasPlayerBeenHit()){
-        if(removePlayerLife()) // returns true if out of lives
-            gotoState(S_END);
-        else
-            gotoState(S_LIFELOST);
+    bool hit = false, dead[MAXPLAYERS] = {false, false};
+    for(int p=0;p<numPlayers;p++){
+        if(hasPlayerBeenHit(p)){
+            hit = true;
+            dead[p] = removePlayerLife(p); // returns true if out of lives
+        }
     }
+    if(!hit)
+        return;
+    if(dead[0] || dead[1]){
+        if(numPlayers > 1)
+            endColour = !dead[me] ? GREEN : dead[1 - me] ? YELLOW : RED;
+        gotoState(S_END);
+    } else
+        gotoState(S_LIFELOST);
 }
 
 void updateModel(){
+    // in versus mode the model waits for the other board
+    if(!stepReady)
+        return;
+
+    // run the timers which are due: the bullets every BULLETINTERVAL
+    // milliseconds and the wall every SCROLLINTERVAL, the Tetris drop, and
+    // the end of LifeLost (see "The timers" above)
+    AberLED.runTasks(gameTime());
+
     switch(state){
     case S_START:
         break;
     case S_PLAYING:
-        // move all the bullets every BULLETINTERVAL milliseconds
-        if(millis()-lastBulletUpdateTime > BULLETINTERVAL) {
-            lastBulletUpdateTime = millis();
-            updateBullets();
-        }
-        // scroll the blocks every SCROLLINTERVAL milliseconds
-        if(millis() - lastScrollTime > SCROLLINTERVAL) {
-            lastScrollTime = millis();
-            scrollAllBlocks();
-            createNewTopWallBlocks();
-        }
         // check the player hasn't collided
-        checkPlayerHit();
+        if(game != G_TETRIS)
+            checkPlayerHit();
         break;
     case S_LIFELOST:
-        // if we're in this state for 2 seconds,
-        // go back to Playing, clearing the screen
-        // of blocks and bullets first.
-        if(getStateTime()>2000){
-            initBlocks();
-            initBullets();
-            gotoState(S_PLAYING);
-        }
         break;
     case S_END:
         break;
     default:
-        Serial.println("Bad state in update!");
+        AberLED.trace(T_BADSTATE, BAD_UPDATE);
         break;
     }
+#if VERSUS
+    if(versus)
+        finishStep();
+#endif
 }
 
 // draw a box of a given colour
 void renderBox(int colour) {
-    for(int i=0;i<8;i++){
-        AberLED.set(0,i,colour); // left edge
-        AberLED.set(7,i,colour); // right edge
-        AberLED.set(i,0,colour); // top edge
-        AberLED.set(i,7,colour); // bottom edge
-    }
+    AberLED.vline(0,0,8,colour); // left edge
+    AberLED.vline(7,0,8,colour); // right edge
+    AberLED.hline(0,0,8,colour); // top edge
+    AberLED.hline(0,7,8,colour); // bottom edge
 }
 
 void render(){
+    // these only redraw the digits which have changed, so it's fine to do
+    // this every frame
+    AberLED.setHudNumber(HUD_LIVES, playerLives[me]);
+    AberLED.setHudNumber(HUD_LINES, linesCleared);
+
     switch(state){
     case S_START:
-        // just draw a green box
+        // just draw a green box - or yellow while looking for another board
+#if VERSUS
+        if(linking){
+            renderBox(YELLOW);
+            break;
+        }
+#endif
         renderBox(GREEN);
         break;
     case S_PLAYING:
         // draw the game 
-        renderBlocks();
-        renderPlayer();
-        renderBullets();
+        if(game == G_TETRIS)
+            renderField();
+        else {
+            renderBlocks();
+            renderPlayer();
+            renderBullets();
+        }
         break;
     case S_LIFELOST:
         // draw a yellow box and remaining lives
@@ -433,11 +1210,11 @@ void render(){
         renderLives();
         break;
     case S_END:
-        // draw a red box
-        renderBox(RED);
+        // draw a red box (or green if we won a versus match)
+        renderBox(endColour);
         break;
     default:
-        Serial.println("Bad state in render!");
+        AberLED.trace(T_BADSTATE, BAD_RENDER);
         break;
     }
 }
@@ -445,9 +1222,17 @@ void render(){
 // and we don't change anything below this point
 
 void loop(){
-    handleInput();
-    updateModel();
+    // these time each part of the loop if ABERLED_STATS is on (see
+    // AberLED.getFrameStats()), and just call it if not.
+    ABERLED_TIMED(AT_INPUT, handleInput());
+    ABERLED_TIMED(AT_UPDATE, updateModel());
     AberLED.clear();
-    render();
+    ABERLED_TIMED(AT_RENDER, render());
+    // sleep until a timer is due or a button changes - but not while
+    // talking to another board, whose packets it doesn't wait for
+#if VERSUS
+    if(!versus && !linking)
+#endif
+        AberLED.idleUntilTask();
     AberLED.swap();
 }
@@ -19,21 +19,52 @@
  * libraries installed.
  */
 
-#include "TFT_ST7735.h"
-#include <SPI.h>
-
 #include "AberLED.h"
 
-const char *AberLEDClass::version(){
+#if ABERLED_DISPLAY != ABERLED_LED
+#include "TFT_ST7735.h"
+#include <SPI.h>
+#endif
+#if ABERLED_DISPLAY != ABERLED_TFT
+#include "TFT_FastPin.h"
+#endif
+
+#if ABERLED_HOST
+// running on a desktop machine - see extras/host
+#include "AberLED_Host.h"
+#endif
+
+// called while waiting for the interrupt to do something. On the host, that's
+// the only way the interrupt gets to run.
+#if ABERLED_HOST
+#define IDLE() hostTick()
+#else
+#define IDLE()
+#endif
+
+// called by idleUntilTask() to sleep until the next interrupt. Idle mode
+// leaves the timers and the serial port running, and any of them wakes it.
+#if ABERLED_HOST
+#define SLEEP() hostTick()
+#else
+#include <avr/sleep.h>
+#define SLEEP() \
+    do { \
+        set_sleep_mode(SLEEP_MODE_IDLE); \
+        sleep_mode(); \
+    } while (0)
+#endif
+
+const __FlashStringHelper *AberLEDClass::version(){
     // which line of the LED we'll be drawn on
-    //      00000000000000000000011111111
-    return "v3.3 ETERNAL EVENING 16-11-23";
+    //        00000000000000000000011111111
+    return F("v3.3 ETERNAL EVENING 16-11-23");
 }
 
 
-// pin mappings - the actual refresh code uses direct
-// port manipulation, so YOU MUST CHANGE THAT TOO IF YOU
-// CHANGE THESE!
+// pin mappings - the refresh code reaches these through the
+// FastPin templates, so each is a single instruction to set or
+// clear. They must be constants, but can be any digital pins.
 
 // pins for the row shift register
 #define RDATA 2
@@ -52,21 +83,290 @@ static uint16_t bufferA[8];
 static uint16_t bufferB[8];
 
 // these are pointers to the back and front buffers
-static uint16_t *backBuffer;
+uint16_t *AberLEDClass::backBuffer;
 static uint16_t *frontBuffer;
 
-// button variables
-static byte buttonStates[] = {0, 0, 0, 0, 0};          // set in swap()
-static byte debouncedButtonStates[] = {0, 0, 0, 0, 0}; // set in interrupt
-static byte buttonDebounceCounters[] = {0, 0, 0, 0, 0};
-static byte buttonWentDown[] = {0, 0, 0, 0, 0};
-static byte buttonWentDownInLastLoop[] = {0, 0, 0, 0, 0};
-static int boardRev = -1;
+#if ABERLED_HOST
+// this is the host's display, see AberLED_Host.h
+uint16_t hostFrame[8];
+#endif
+
+#define USEBCM (ABERLED_BCM && ABERLED_DISPLAY != ABERLED_TFT)
+#if USEBCM
+// the brightness buffers for AF_BCM, which are swapped with the others. These
+// are bit planes: levels[y][i] is row y with bit i of each LED's level, in
+// the same layout as the frame buffers (and what the column shift registers
+// take), so the interrupt can send a plane straight out.
+static uint16_t levelsA[8][4];
+static uint16_t levelsB[8][4];
+static uint16_t (*levelBack)[4] = levelsA;
+static uint16_t (*levelFront)[4] = levelsB;
+// set by begin() if we're using them
+static bool bcm = false;
+#endif
+
+#if ABERLED_DISPLAY != ABERLED_LED
+// this is a copy of what is actually on the TFT at the moment, so that
+// we only need to redraw the cells which have changed.
+static uint16_t shownBuffer[8];
+// if set, ignore shownBuffer and redraw every cell on every refresh
+static bool fullRefresh = false;
+// if set, the TFT is drawn all at once in swap() rather than a row at a time
+// by the interrupt, which then only handles the buttons
+static bool blitOnSwap = false;
+// if set, swap() puts the changed cells into the TFT's drawing queue and
+// the interrupt draws a few of them every tick
+static bool asyncTFT = false;
+// how many queued cells or characters the interrupt will draw each tick - a
+// row of cells, so a whole frame takes 8 ticks as it does when the interrupt
+// draws a row at a time
+#define QUEUECELLSPERTICK 8
+// the grid of cells is the TFT's hardware scrolling area, and has been
+// scrolled down by scrollRows rows (0-7) - so row y of the buffers is drawn
+// at row (y - scrollRows) & 7 of the TFT's memory. scrollPending counts the
+// scrollDown() calls since the last swap.
+#define GRIDHEIGHT 128
+static volatile byte scrollRows = 0;
+static byte scrollPending = 0;
+#endif
+
+// button variables - these hold one bit for each button, bit 0 for button 1
+// and so on up to bit 4 for button 5.
+static byte buttonStates = 0;                   // set in swap()
+static volatile byte debouncedButtonStates = 0; // set in interrupt
+static volatile byte buttonWentDown = 0;        // set in interrupt
+static byte buttonWentDownInLastLoop = 0;       // set in swap()
+
+// The interrupt reads all the buttons at once by combining PC0-PC3 and PB1
+// into a 5-bit number (with PB1 as bit 4), and looks up which buttons are
+// pressed in this table. The table depends on the board revision, so
+// it's set up in setRevision().
+static byte buttonMap[32];
+
+// button presses and releases are also put into this circular queue by the
+// interrupt, to be read by pollEvent(). Must be a power of 2.
+#define EVENTQUEUESIZE 16
+static AberLEDEvent eventQueue[EVENTQUEUESIZE];
+static volatile byte eventHead = 0; // only written by the interrupt
+static volatile byte eventTail = 0; // only written by pollEvent()
+static volatile uint16_t lostEvents = 0;
+
+// counts every interrupt tick, and wraps around
+static volatile uint16_t tickCount = 0;
 
 int ticks = 0;
+// the game time at the last swap (see getFrameTime()), and how long a tick is
+static unsigned long frameTime = 0;
+static byte msPerTick = 0;
 bool interruptRunning = false;
 volatile int interruptTicks = 0;
+// number of rows of the front buffer sent to the display since the last swap
+static volatile byte rowsDrawn = 0;
+// if set, swap() returns immediately instead of waiting for the interrupt
+static bool noWait = false;
+
+// the scheduler's tasks, see addTask(). due is when the next run is due, on
+// whatever clock the sketch gives runTasks().
+struct Task {
+    void (*fn)();
+    uint16_t period;
+    bool running;
+    unsigned long due;
+};
+static Task tasks[ABERLED_TASKS];
+static byte numTasks = 0;
+// how many periods behind a task can fall before runs are dropped
+#define MAXCATCHUP 4
+
+// the interrupt only draws every refreshDivider ticks. This is the divider
+// asked for with setRefreshRate(), or more if adaptive refresh has raised it.
+#define MAXREFRESHDIVIDER 16
+static volatile byte refreshDivider = 1;
+static byte baseRefreshDivider = 1;
+// for adaptive refresh: the largest share of the CPU the interrupt should
+// use in percent (0 for off), and the timer 1 counts it has been busy for
+// and the ticks that have gone by since it was last checked
+#define ADAPTTICKS 64
+static byte maxInterruptLoad = 0;
+static volatile uint32_t interruptBusy = 0;
+static uint16_t adaptTicks = 0;
+static uint32_t adaptBusy = 0;
+
+#if ABERLED_DISPLAY == ABERLED_BOTH
+// set by begin() to say which display we're using
 bool isTFT;
+#else
+// only one display has been compiled in, so all the tests of this go away
+static const bool isTFT = ABERLED_DISPLAY == ABERLED_TFT;
+#endif
+
+inline void refreshNextRow();
+static void refreshAllRows();
+
+/*
+ * The displays. Each of these has the same static functions, which the rest
+ * of the code calls through Display:
+ *
+ *   init(flags, colourMap)  set up the hardware and clear the display
+ *   refreshRow(row)         send one row of the front buffer to the display
+ *   tick()                  do the interrupt's drawing, returning false if none
+ *   refreshAll()            draw the whole front buffer, for refresh()
+ *   swapped()               called by swapAsync() once the buffers are exchanged
+ *   frameReady()            is the front buffer all on the display yet?
+ *   setupTimer()            set timer 1 to run the interrupt at the right rate
+ *
+ * If ABERLED_DISPLAY in AberLED_Setup.h picks one of them, Display is that one,
+ * so the calls are inlined and the other isn't compiled at all. Otherwise it's
+ * BothDisplays, which chooses at run time from isTFT.
+ */
+
+#if ABERLED_DISPLAY != ABERLED_TFT
+struct LEDDisplay {
+    static void init(AberLEDFlags flags, uint8_t *colourMap);
+    static inline void refreshRow(int row);
+    static inline void nextPlane();
+    static inline bool tick();
+    static void refreshAll();
+    static void swapped() {}
+    static bool frameReady() { return rowsDrawn >= 8; }
+    static void setupTimer();
+};
+#endif
+
+#if ABERLED_DISPLAY != ABERLED_LED
+struct TFTDisplay {
+    static void init(AberLEDFlags flags, uint8_t *colourMap);
+    static inline void refreshRow(int row);
+    static inline bool tick();
+    static void refreshAll();
+    static void swapped();
+    static bool frameReady();
+    static void setupTimer();
+};
+#endif
+
+#if ABERLED_DISPLAY == ABERLED_BOTH
+struct BothDisplays {
+    static void init(AberLEDFlags flags, uint8_t *colourMap) {
+        if (isTFT)
+            TFTDisplay::init(flags, colourMap);
+        else
+            LEDDisplay::init(flags, colourMap);
+    }
+    static inline void refreshRow(int row) {
+        if (isTFT)
+            TFTDisplay::refreshRow(row);
+        else
+            LEDDisplay::refreshRow(row);
+    }
+    static inline bool tick() {
+        return isTFT ? TFTDisplay::tick() : LEDDisplay::tick();
+    }
+    static void refreshAll() {
+        if (isTFT)
+            TFTDisplay::refreshAll();
+        else
+            LEDDisplay::refreshAll();
+    }
+    static void swapped() {
+        if (isTFT)
+            TFTDisplay::swapped();
+    }
+    static bool frameReady() {
+        return isTFT ? TFTDisplay::frameReady() : LEDDisplay::frameReady();
+    }
+    static void setupTimer() {
+        if (isTFT)
+            TFTDisplay::setupTimer();
+        else
+            LEDDisplay::setupTimer();
+    }
+};
+typedef BothDisplays Display;
+#elif ABERLED_DISPLAY == ABERLED_TFT
+typedef TFTDisplay Display;
+#else
+typedef LEDDisplay Display;
+#endif
+
+#if ABERLED_STATS
+// timing statistics, one for each AberLEDTimer. The interrupt only writes
+// AT_ISR and AT_REFRESH, and the main code only writes the others.
+static AberLEDTiming stats[AT_COUNT];
+
+// add a time in microseconds to the statistics
+static void recordTime(byte timer, unsigned long us)
+{
+    AberLEDTiming *t = stats + timer;
+    uint16_t v = us > 0xffff ? 0xffff : us;
+    if (v < t->min)
+        t->min = v;
+    if (v > t->max)
+        t->max = v;
+    t->total += v;
+    t->count++;
+
+    // find the bucket: under 8, then up by a factor of 4 each time
+    byte b = 0;
+    for (v >>= 3; v && b < AT_HISTBUCKETS - 1; v >>= 2)
+        b++;
+    if (t->hist[b] != 0xffff)
+        t->hist[b]++;
+}
+
+// convert a number of timer 1 counts into microseconds - the timer runs
+// at 250kHz for the TFT and 2MHz for the LED
+static inline unsigned long timerToMicros(uint16_t n)
+{
+    return isTFT ? (unsigned long)n * 4 : n / 2;
+}
+#endif
+
+#if ABERLED_TRACE
+// The trace log is a circular buffer of records, which is only
+// used by the main code, never the interrupt.
+struct TraceRecord {
+    byte id, arg;
+    uint16_t delta; // milliseconds since the previous record
+};
+static TraceRecord traceBuffer[ABERLED_TRACESIZE];
+static byte traceHead = 0, traceTail = 0;
+static unsigned long lastTraceTime = 0;
+// records we couldn't store since the buffer was last full
+static byte traceLost = 0;
+// set once the sketch has traced something (or started recording), so
+// flushTrace() knows Serial is in use. The library's own records are only
+// kept once it is set - see libraryTrace().
+static bool tracing = false;
+
+// set by startRecording(), to trace each frame's input
+static bool recording = false;
+// set by startReplay(), to read each frame's input from here
+static Stream *replayStream = NULL;
+static void replayFrame();
+
+// each record is sent as this byte, the id, the arg, the delta (low byte
+// first) and the exclusive-or of the four bytes after the sync byte
+#define TRACESYNC 0xa5
+
+static void libraryTrace(byte id, byte arg);
+
+static bool storeTrace(byte id, byte arg)
+{
+    byte next = (traceHead + 1) & (ABERLED_TRACESIZE - 1);
+    if (next == traceTail)
+        return false;
+    unsigned long now = millis();
+    unsigned long delta = now - lastTraceTime;
+    lastTraceTime = now;
+    TraceRecord *r = traceBuffer + traceHead;
+    r->id = id;
+    r->arg = arg;
+    r->delta = delta > 0xffff ? 0xffff : delta;
+    traceHead = next;
+    return true;
+}
+#endif
 
 #define MAXTEXTLEN 32
 // we only render text when it has changed, so we keep the previously rendered text
@@ -81,13 +381,13 @@ AberLEDClass AberLED;
  */
 
 
-
+#if ABERLED_DISPLAY != ABERLED_LED
 TFT_ST7735 tft = TFT_ST7735();
+#endif
 
 
 void AberLEDClass::setRevision(int rev)
 {
-    boardRev = rev;
     if (rev == REV01)
     {
         UP = 1;
@@ -104,6 +404,22 @@ void AberLEDClass::setRevision(int rev)
         RIGHT = 3;
         FIRE = 5;
     }
+
+    // which bit of the combined port reading each button is on
+    static const byte rev00Bits[] PROGMEM = {2, 1, 4, 8, 16};
+    static const byte rev01Bits[] PROGMEM = {1, 8, 4, 2, 16};
+    const byte *bits = rev == REV00 ? rev00Bits : rev01Bits;
+
+    for (int pins = 0; pins < 32; pins++)
+    {
+        byte pressed = 0;
+        for (int i = 0; i < 5; i++)
+        {
+            if (!(pins & pgm_read_byte(bits + i))) // buttons pull their pins low
+                pressed |= 1 << i;
+        }
+        buttonMap[pins] = pressed;
+    }
 }
 
 int AberLEDClass::getTicks()
@@ -111,102 +427,258 @@ int AberLEDClass::getTicks()
     return ticks;
 }
 
-// these are faster routines for doing the shift register writes
+unsigned long AberLEDClass::getFrameTime()
+{
+    return frameTime;
+}
 
-static void fastShiftOutRows(byte n)
+#if ABERLED_DISPLAY != ABERLED_TFT
+// these are faster routines for doing the shift register writes. The
+// FastPin templates turn each pin change into a single sbi or cbi, and
+// ShiftOut is unrolled by the compiler, so there is no loop and no
+// shifting of masks at run time.
+
+typedef FastPin<RDATA> RowData;
+typedef FastPin<RLATCH> RowLatch;
+typedef FastPin<RCLOCK> RowClock;
+typedef FastPin<CDATA> ColData;
+typedef FastPin<CCLOCK> ColClock;
+typedef FastPin<CLATCH> ColLatch;
+
+// clock bits BIT down to 0 of n into the register on the DATA and CLOCK
+// pins. The data line must be low to start with, and is left low.
+template <class DATA, class CLOCK, int BIT> struct ShiftOut
 {
-    PORTD &= ~(1 << 2); // data off
-    for (int i = 7; i >= 0; i--)
+    static inline void bits(uint16_t n) __attribute__((always_inline))
     {
-        PORTD &= ~(1 << 4); // clock off
-        if (n & (1 << i))
-            PORTD |= 1 << 2; // data on if true
-        else
-            PORTD &= ~(1 << 2); // data off if true
-        PORTD |= 1 << 4;        // clock on
+        CLOCK::lo();
+        if (n & (1u << BIT))
+            DATA::hi(); // data on if true (it's already off otherwise)
+        CLOCK::hi();
+        DATA::lo(); // data off (to prevent bleed through)
+        ShiftOut<DATA, CLOCK, BIT - 1>::bits(n);
+    }
+};
 
-        PORTD &= ~(1 << 2); // data off (to prevent bleed through)
+template <class DATA, class CLOCK> struct ShiftOut<DATA, CLOCK, -1>
+{
+    static inline void bits(uint16_t) __attribute__((always_inline))
+    {
+        CLOCK::lo(); // clock off
     }
-    PORTD &= ~(1 << 4); // clock off
+};
+
+typedef ShiftOut<RowData, RowClock, 7> RowShift;
+typedef ShiftOut<ColData, ColClock, 15> ColShift;
+
+static void fastShiftOutRows(byte n)
+{
+    RowData::lo();
+    RowShift::bits(n);
+}
+
+// (not static, so that examples/bench can time it)
+void fastShiftOutCols(uint16_t n)
+{
+    ColData::lo();
+    ColShift::bits(n);
 }
 
-static void fastShiftOutCols(uint16_t n)
+// this initialiser is used when using a bicolor LED display
+void LEDDisplay::init(AberLEDFlags flags, uint8_t *colourMap)
 {
-    PORTD &= ~(1 << 5); // data off
-    for (int i = 15; i >= 0; --i)
+    // set all the shift register pins to output
+    ColLatch::setOutput();
+    ColData::setOutput();
+    ColClock::setOutput();
+    RowLatch::setOutput();
+    RowData::setOutput();
+    RowClock::setOutput();
+
+    // clear the SRs
+
+    RowLatch::lo();
+    fastShiftOutRows(0);
+    RowLatch::hi();
+
+    ColLatch::lo();
+    fastShiftOutCols(0);
+    ColLatch::hi();
+
+#if USEBCM
+    bcm = (flags & AF_BCM) && !(flags & AF_NOINTERRUPT);
+    memset(levelsA, 0, sizeof(levelsA));
+    memset(levelsB, 0, sizeof(levelsB));
+#endif
+}
+
+#if USEBCM
+// Bit-angle modulation. Each tick the interrupt starts a row with plane 0
+// (bit 0 of every level) and sets compare B for one slice later, when
+// nextPlane() puts up plane 1 for two slices, then plane 2 for four and
+// plane 3 for eight - 15 slices to the tick, so each plane is lit for its
+// bit's share of the time. The frame buffer is ORed into every plane, so
+// set() colours stay at full brightness. When the refresh divider holds a
+// row for more than one tick, a sixteenth compare blanks it at the end of
+// the 15 slices, or plane 3 would get the extra ticks.
+
+// timer 1 counts in a slice, from setupTimer()'s 2ms tick
+#define BCMSLICE ((3999 + 1) / 15)
+static byte bcmRow;
+static byte bcmPlane;
+
+inline void LEDDisplay::nextPlane()
+{
+    byte p = bcmPlane;
+    if (p < 4)
     {
-        PORTD &= ~(1 << 6); // clock off
-        if (n & (1 << i))
-            PORTD |= 1 << 5; // data on if true
+        ColLatch::lo();
+        ColShift::bits(~(levelFront[bcmRow][p] | frontBuffer[bcmRow]));
+        ColLatch::hi();
+        if (p < 3)
+            OCR1B += BCMSLICE << p;
+        else if (refreshDivider > 1)
+            OCR1B += BCMSLICE << 3;
         else
-            PORTD &= ~(1 << 5); // data off if true
-        PORTD |= 1 << 6;        // clock on
-        PORTD &= ~(1 << 5);     // data off (to prevent bleed through)
+            TIMSK1 &= ~(1 << OCIE1B); // lit until the next row
+        bcmPlane = p + 1;
+    }
+    else
+    {
+        ColLatch::lo();
+        ColShift::bits(0xffff);
+        ColLatch::hi();
+        TIMSK1 &= ~(1 << OCIE1B);
     }
-    PORTD &= ~(1 << 6); // clock off
 }
+#endif
 
-static void setupInterrupt();
+// this code is used for the older LED boards, and use the shift registers -
+// we go straight to the port registers for speed.
+inline void LEDDisplay::refreshRow(int row)
+{
+#if ABERLED_HOST
+    // no compare B here, so show the brightest plane
+    hostFrame[row] = frontBuffer[row];
+#if USEBCM
+    if (bcm)
+        hostFrame[row] |= levelFront[row][3];
+#endif
+#else
+    if (!row)
+        RowData::hi(); // turn on the row data line to get the first bit set
+
+    // set latches low
+    RowLatch::lo();
+    ColLatch::lo();
+
+    // tick the row clock to move the next bit in (high on
+    // the first row, low after that)
+    RowClock::strobe();
+
+    // and turn off the row data line
+    RowData::lo();
+
+    // now the appropriate row is set high, set the column
+    // bits low for the pixels we want. This is inlined rather
+    // than calling fastShiftOutCols(), as it's in the interrupt.
+
+#if USEBCM
+    if (bcm)
+    {
+        // start on plane 0, and have compare B bring in the others
+        ColShift::bits(~(levelFront[row][0] | frontBuffer[row]));
+        bcmRow = row;
+        bcmPlane = 1;
+        OCR1B = BCMSLICE;
+        TIFR1 = 1 << OCF1B;
+        TIMSK1 |= 1 << OCIE1B;
+    }
+    else
+#endif
+        ColShift::bits(~(frontBuffer[row]));
+    // and latch the registers
 
+    RowLatch::hi();
+    ColLatch::hi();
+#endif
+}
 
-// this is the colour map for the TFT display. It's an array of 16 bits per colour in a 565 format
-// (5 bits red, 6 bits green, 5 bits blue). It is initialised with the colours black, green, red
-// and yellow, but you can change it if you want to by calling AberLED.begin() with a colour map.
+inline bool LEDDisplay::tick()
+{
+    refreshNextRow();
+    return true;
+}
 
-static uint16_t cols[] = {ST7735_BLACK, ST7735_GREEN, ST7735_RED, ST7735_YELLOW};
+void LEDDisplay::refreshAll()
+{
+    refreshAllRows();
 
-void AberLEDClass::begin(AberLEDFlags flags, uint8_t *colourMap){
-    setRevision(REV01);
-    isTFT = (flags & AF_TFTDISPLAY) != 0;
+    // hold the last line for a little while
+    for (int volatile i = 0; i < 30; i++)
+    {
+        __asm__ __volatile__("nop\n\t");
+    }
 
-    // set all the shift register pins to output
-    if (isTFT) {
-        // Use this initializer if you're using a 1.44" TFT
-        tft.init();
-        tft.setRotation(2);
-        tft.fillScreen(TFT_BLACK);
-
-        tft.setCursor(4, 4);
-        tft.setTextColor(TFT_WHITE);
-        tft.setTextWrap(true);
-        tft.print("Arduino LED\n\n");
-        tft.setTextColor(TFT_GREEN);
-        tft.print(version());
-        delay(2000);
-
-        tft.fillScreen(TFT_BLACK);
-
-        if(colourMap){
-            for(int i=0;i<4;i++){
-                uint16_t r = (*colourMap++ >> 3) & 0x1f;    // chop down frop 8 bits to 5
-                r <<= 11;                                   // put into the right place
-                uint16_t g = (*colourMap++ >> 2) & 0x3f;    // chop down frop 8 bits to 6
-                g <<= 5;                                    // put into the right place
-                uint16_t b = (*colourMap++ >> 3) & 0x1f;    // chop down frop 8 bits to 5
-                cols[i] = r | g | b;
-            }
-        }
+    //    // latch off values into the columns, to avoid last row bright.
+    RowLatch::lo();
+    ColLatch::lo();
+    fastShiftOutCols(0xffff);
+    RowLatch::hi();
+    ColLatch::hi();
+}
 
+void LEDDisplay::setupTimer()
+{
+    // set compare match register for correct frequency
+    // (16*10^6) / (500*8) - 1 gives 3999 (for 500Hz)
+    msPerTick = 2;
+    OCR1A = 3999;
+    // turn on CTC mode
+    TCCR1B |= (1 << WGM12);
+    // Set prescaler to 8
+    TCCR1B |= (1 << CS11);
+}
+#endif
 
-    } else {
-        // this initialiser is used when using a bicolor LED display
-        pinMode(CLATCH, OUTPUT);
-        pinMode(CDATA, OUTPUT);
-        pinMode(CCLOCK, OUTPUT);
-        pinMode(RLATCH, OUTPUT);
-        pinMode(RDATA, OUTPUT);
-        pinMode(RCLOCK, OUTPUT);
+static void setupInterrupt();
 
-        // clear the SRs
+#if !ABERLED_HOST
+// the start of the static data and the end of the heap, from the linker
+// and malloc()
+extern char __data_start, __heap_start, *__brkval;
 
-        digitalWrite(RLATCH, LOW);
-        fastShiftOutRows(0);
-        digitalWrite(RLATCH, HIGH);
+// the byte free RAM is painted with, see paintStack()
+#define STACKPAINT 0xc5
 
-        digitalWrite(CLATCH, LOW);
-        fastShiftOutCols(0);
-        digitalWrite(CLATCH, HIGH);
-    }
+static char *heapEnd(){
+    return __brkval ? __brkval : &__heap_start;
+}
+
+// Fill the free RAM below the stack with STACKPAINT. The stack overwrites it
+// as it grows, so memoryReport() can find the deepest it has been by seeing
+// how much paint is left. We stop a little short of our own stack frame.
+static void paintStack(){
+    char here;
+    byte sreg = SREG;
+    cli();
+    for(char *p = heapEnd(); p < &here - 16; p++)
+        *p = STACKPAINT;
+    SREG = sreg;
+}
+#endif
+
+void AberLEDClass::begin(AberLEDFlags flags, uint8_t *colourMap){
+#if !ABERLED_HOST
+    paintStack();
+#endif
+    setRevision(REV01);
+#if ABERLED_DISPLAY == ABERLED_BOTH
+    isTFT = (flags & AF_TFTDISPLAY) != 0;
+#endif
+    noWait = (flags & AF_NOWAIT) != 0;
+
+    Display::init(flags, colourMap);
 
     // set up the switch inputs
     pinMode(A0, INPUT_PULLUP);
@@ -225,66 +697,862 @@ void AberLEDClass::begin(AberLEDFlags flags, uint8_t *colourMap){
     memset(backBuffer, 0, 16);
     memset(frontBuffer, 0, 16);
 
-    txtBuffer[0] = 0;
-    prevTxtBuffer[0] = 0;
+    if (isTFT) {
+        txtBuffer[0] = 0;
+        prevTxtBuffer[0] = 0;
+    }
+
+#if ABERLED_STATS
+    resetFrameStats();
+#endif
 
 
     if (!(flags & AF_NOINTERRUPT))
         setupInterrupt();
 }
 
+#if ABERLED_DISPLAY != ABERLED_LED
+// this is the colour map for the TFT display. It's an array of 16 bits per colour in a 565 format
+// (5 bits red, 6 bits green, 5 bits blue). It is initialised with the colours black, green, red
+// and yellow, but you can change it if you want to by calling AberLED.begin() with a colour map.
+
+static uint16_t cols[] = {ST7735_BLACK, ST7735_GREEN, ST7735_RED, ST7735_YELLOW};
+
+// The tiles which AF_TILES draws instead of the flat squares, one for each colour.
+// Each TILEROW is a row of 12 pixels: 0 for black, 1 for the cell's colour, 2 for
+// a lighter shade and 3 for a darker one, so the shape can be seen in the numbers.
+#define TILEROW(a,b,c,d, e,f,g,h, i,j,k,l) \
+    (a|b<<2|c<<4|d<<6), (e|f<<2|g<<4|h<<6), (i|j<<2|k<<4|l<<6)
+
+static const uint8_t defaultTiles[4*TFT_TILEBYTES] PROGMEM = {
+    // BLACK: nothing
+    TILEROW(0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0),
+    TILEROW(0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0),
+    TILEROW(0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0),
+    TILEROW(0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0),
+    TILEROW(0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0),
+    TILEROW(0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0),
+    TILEROW(0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0),
+    TILEROW(0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0),
+    TILEROW(0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0),
+    TILEROW(0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0),
+    TILEROW(0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0),
+    TILEROW(0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0),
+    // GREEN: a ship
+    TILEROW(0, 0, 0, 0, 0, 2, 1, 0, 0, 0, 0, 0),
+    TILEROW(0, 0, 0, 0, 0, 2, 1, 0, 0, 0, 0, 0),
+    TILEROW(0, 0, 0, 0, 2, 1, 1, 3, 0, 0, 0, 0),
+    TILEROW(0, 0, 0, 0, 2, 1, 1, 3, 0, 0, 0, 0),
+    TILEROW(0, 0, 0, 2, 1, 2, 2, 1, 3, 0, 0, 0),
+    TILEROW(0, 0, 0, 2, 1, 2, 2, 1, 3, 0, 0, 0),
+    TILEROW(0, 0, 2, 1, 1, 1, 1, 1, 1, 3, 0, 0),
+    TILEROW(0, 0, 2, 1, 1, 1, 1, 1, 1, 3, 0, 0),
+    TILEROW(0, 2, 1, 1, 1, 1, 1, 1, 1, 1, 3, 0),
+    TILEROW(2, 1, 1, 1, 3, 1, 1, 3, 1, 1, 1, 3),
+    TILEROW(2, 1, 1, 3, 0, 3, 3, 0, 3, 1, 1, 3),
+    TILEROW(0, 3, 3, 0, 0, 0, 0, 0, 0, 3, 3, 0),
+    // RED: a bevelled brick
+    TILEROW(2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 3),
+    TILEROW(2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 3, 3),
+    TILEROW(2, 2, 1, 1, 1, 1, 1, 1, 1, 1, 3, 3),
+    TILEROW(2, 2, 1, 1, 1, 1, 1, 1, 1, 1, 3, 3),
+    TILEROW(2, 2, 1, 1, 1, 1, 1, 1, 1, 1, 3, 3),
+    TILEROW(2, 2, 1, 1, 1, 1, 1, 1, 1, 1, 3, 3),
+    TILEROW(2, 2, 1, 1, 1, 1, 1, 1, 1, 1, 3, 3),
+    TILEROW(2, 2, 1, 1, 1, 1, 1, 1, 1, 1, 3, 3),
+    TILEROW(2, 2, 1, 1, 1, 1, 1, 1, 1, 1, 3, 3),
+    TILEROW(2, 2, 1, 1, 1, 1, 1, 1, 1, 1, 3, 3),
+    TILEROW(2, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3),
+    TILEROW(3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3),
+    // YELLOW: a riveted block
+    TILEROW(2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 3),
+    TILEROW(2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 3, 3),
+    TILEROW(2, 2, 1, 1, 1, 1, 1, 1, 1, 1, 3, 3),
+    TILEROW(2, 2, 1, 3, 1, 1, 1, 1, 3, 1, 3, 3),
+    TILEROW(2, 2, 1, 1, 1, 1, 1, 1, 1, 1, 3, 3),
+    TILEROW(2, 2, 1, 1, 1, 2, 2, 1, 1, 1, 3, 3),
+    TILEROW(2, 2, 1, 1, 1, 3, 3, 1, 1, 1, 3, 3),
+    TILEROW(2, 2, 1, 1, 1, 1, 1, 1, 1, 1, 3, 3),
+    TILEROW(2, 2, 1, 3, 1, 1, 1, 1, 3, 1, 3, 3),
+    TILEROW(2, 2, 1, 1, 1, 1, 1, 1, 1, 1, 3, 3),
+    TILEROW(2, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3),
+    TILEROW(3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3),
+};
+
+// the tiles in use, or NULL for flat squares, and the 4 colours for each tile,
+// worked out from cols[]
+static const uint8_t *tileSheet = NULL;
+static uint16_t tilePalettes[16];
+
+static void makeTilePalettes(){
+    for(int i=0;i<4;i++){
+        uint16_t c = cols[i];
+        uint16_t half = (c >> 1) & 0x7bef;  // each of r, g and b halved
+        tilePalettes[i*4] = TFT_BLACK;
+        tilePalettes[i*4+1] = c;
+        tilePalettes[i*4+2] = half + 0x7bef; // half way to white
+        tilePalettes[i*4+3] = half;
+    }
+}
+
+void TFTDisplay::init(AberLEDFlags flags, uint8_t *colourMap)
+{
+    fullRefresh = (flags & AF_FULLREFRESH) != 0;
+    asyncTFT = (flags & AF_ASYNCTFT) && !(flags & AF_NOINTERRUPT);
+    blitOnSwap = (flags & AF_BLITONSWAP) && !asyncTFT;
+
+    // Use this initializer if you're using a 1.44" TFT
+    tft.init();
+    tft.setRotation(2);
+    tft.fillScreen(TFT_BLACK);
+
+    tft.setCursor(4, 4);
+    tft.setTextColor(TFT_WHITE);
+    tft.setTextWrap(true);
+    tft.print(F("Arduino LED\n\n"));
+    tft.setTextColor(TFT_GREEN);
+    tft.print(AberLEDClass::version());
+    delay(2000);
+
+    tft.fillScreen(TFT_BLACK);
+    // the screen has just been cleared to black, which is what a zeroed buffer shows
+    memset(shownBuffer, 0, 16);
+
+    // scrollDown() moves the grid and leaves the text area below it alone
+    tft.setScrollArea(0, GRIDHEIGHT);
+    tft.scrollTo(0);
+    scrollRows = 0;
+    scrollPending = 0;
+
+    if(colourMap){
+        for(int i=0;i<4;i++){
+            uint16_t r = (*colourMap++ >> 3) & 0x1f;    // chop down frop 8 bits to 5
+            r <<= 11;                                   // put into the right place
+            uint16_t g = (*colourMap++ >> 2) & 0x3f;    // chop down frop 8 bits to 6
+            g <<= 5;                                    // put into the right place
+            uint16_t b = (*colourMap++ >> 3) & 0x1f;    // chop down frop 8 bits to 5
+            cols[i] = r | g | b;
+        }
+    }
+
+    makeTilePalettes();
+    tileSheet = (flags & AF_TILES) ? defaultTiles : NULL;
+    tft.setTiles(tileSheet, tilePalettes);
+    tft.setCellColours(cols);
+}
+
+// set while the main code is drawing on the TFT, so that the interrupt
+// leaves it alone - a row it skips will be drawn on the next tick.
+static volatile bool tftBusy = false;
+
+// These draw on the TFT, either immediately or by adding to the
+// drawing queue if we're in asynchronous mode. If the queue is full
+// we wait for the interrupt to make some space.
+
+static void tftFillRect(int16_t x, int16_t y, int16_t w, int16_t h, uint16_t col){
+    if(asyncTFT){
+        while(!tft.queueFillRect(x, y, w, h, col)){
+            IDLE();
+        }
+    } else
+        tft.fillRect(x, y, w, h, col);
+}
+
+static void tftDrawChar(int16_t x, int16_t y, char c, uint16_t col, uint16_t bg){
+    if(asyncTFT){
+        while(!tft.queueChar(x, y, c, col, bg)){
+            IDLE();
+        }
+    } else
+        tft.drawChar(x, y, c, col, bg, 1);
+}
+
+static void tftDrawTile(int16_t x, int16_t y, uint8_t tile){
+    if(asyncTFT){
+        while(!tft.queueTile(x, y, tile)){
+            IDLE();
+        }
+    } else
+        tft.drawTile(x, y, tile);
+}
+
+// queue up to 8 cells as a single operation (asynchronous mode only)
+static void tftQueueCells(int16_t x, int16_t y, uint8_t pitch, uint8_t size,
+                          uint16_t bits, uint16_t changed){
+    while(!tft.queueCells(x, y, pitch, size, bits, changed)){
+        IDLE();
+    }
+}
+
+// the y coordinate of the top of the cells in a row, allowing for the scrolling
+static inline int16_t cellY(int row){
+    return 16*((row - scrollRows) & 7) + 2;
+}
+
+// draw the cells of a row which are marked in changed, each as a size x size
+// square with its top left corner at (x, y) and moving on by pitch each time.
+// The squares are tiles if there are tiles, and they are the right size.
+// This is a template so the interrupt's 8x8 rows don't need 32-bit shifts.
+template <class Row>
+static void drawCellRow(int16_t x, int16_t y, uint8_t pitch, uint8_t size,
+                        Row v, Row changed){
+    if(asyncTFT){
+        // queue each 8 cells as one operation, so a whole frame fits in the
+        // queue - the interrupt draws them a cell at a time
+        for(uint8_t i=0;i<sizeof(Row)/2;i++){
+            tftQueueCells(x, y, pitch, size, v, changed);
+            x += 8*pitch;
+            v = (uint32_t)v >> 16;
+            changed = (uint32_t)changed >> 16;
+        }
+        return;
+    }
+    bool tiles = tileSheet && size == TFT_TILESIZE;
+    for(;changed;x+=pitch){
+        if(changed & 3){
+            if(tiles)
+                tftDrawTile(x, y, v & 3);
+            else
+                tftFillRect(x, y, size, size, cols[v & 3]);
+        }
+        v >>= 2;
+        changed >>= 2;
+    }
+}
+
+// draw the cells in a row of the front buffer which differ from what is already
+// on the screen.
+static void drawChangedCells(int row){
+    uint16_t v = frontBuffer[row];
+
+    // each changed cell will have at least one of its two bits set in here.
+    uint16_t changed = fullRefresh ? 0xffff : v ^ shownBuffer[row];
+    shownBuffer[row] = v;
+
+    drawCellRow<uint16_t>(2, cellY(row), 16, 12, v, changed);
+}
+
+// The text area uses the 6x8 font starting at (4,150), wrapping at the right
+// edge just as tft.print() would. This tracks where each character goes.
+struct TextCursor {
+    int16_t x, y;
+    TextCursor() : x(4), y(150) {}
+    // move to where the character c will be drawn, returning false if it doesn't
+    // draw anything. Call next() after drawing it.
+    bool place(char c){
+        if(c == '\n'){
+            x = 0;
+            y += 8;
+            return false;
+        }
+        if(c == '\r')
+            return false;
+        if(x + 6 >= 128){
+            x = 0;
+            y += 8;
+        }
+        return true;
+    }
+    void next(){
+        x += 6;
+    }
+};
+
 // render the text to the screen, if it is not the same text as was previously rendered.
+// Only the characters which have changed (or moved) are redrawn: first the old
+// characters are rubbed out, then the new ones are drawn.
 static void renderText(){
-    if(strcmp(txtBuffer, prevTxtBuffer)){
-        Serial.println(txtBuffer);
-        strcpy(prevTxtBuffer, txtBuffer);
-        tft.fillRect(0, 150, 128, 16, TFT_BLACK);
-        // we display the text in the front buffer
-        if(txtBuffer[0]){
-            tft.setTextColor(TFT_WHITE);
-            tft.setCursor(4, 150);
-            tft.print(txtBuffer);
+    if(!strcmp(txtBuffer, prevTxtBuffer))
+        return;
+#if ABERLED_TRACE
+    libraryTrace(TRACE_TEXT, strlen(txtBuffer));
+#endif
+#if ABERLED_STATS
+    unsigned long start = micros();
+#endif
+
+    // (in asynchronous mode we only queue operations, so we mustn't touch the SPI bus)
+    if(!asyncTFT){
+        tftBusy = true;
+        tft.beginBurst();
+    }
+    for(int pass=0;pass<2;pass++){
+        TextCursor oldPos, newPos;
+        bool oldDone = false, newDone = false;
+        for(int i=0;i<MAXTEXTLEN && !(oldDone && newDone);i++){
+            char oc = oldDone ? 0 : prevTxtBuffer[i];
+            char nc = newDone ? 0 : txtBuffer[i];
+            oldDone = !oc;
+            newDone = !nc;
+            bool oldDrawn = oc && oldPos.place(oc);
+            bool newDrawn = nc && newPos.place(nc);
+            // is the character already on the screen, exactly where it should be?
+            bool same = oldDrawn && newDrawn && oc == nc &&
+                        oldPos.x == newPos.x && oldPos.y == newPos.y;
+            if(!same){
+                if(pass == 0 && oldDrawn && oldPos.y < 160)
+                    tftFillRect(oldPos.x, oldPos.y, 6, min(8, 160 - oldPos.y), TFT_BLACK);
+                if(pass == 1 && newDrawn)
+                    tftDrawChar(newPos.x, newPos.y, nc, TFT_WHITE, TFT_BLACK);
+            }
+            if(oldDrawn)
+                oldPos.next();
+            if(newDrawn)
+                newPos.next();
         }
     }
+    if(!asyncTFT){
+        tft.endBurst();
+        tftBusy = false;
+    }
+
+    strcpy(prevTxtBuffer, txtBuffer);
+#if ABERLED_STATS
+    recordTime(AT_TEXT, micros() - start);
+#endif
 }
 
+// The HUD fields. Each remembers the characters it has on the screen, so that
+// only the ones which differ are drawn - each is a single windowed burst from
+// drawChar(), or queued in asynchronous mode.
+#define HUDMAXDIGITS 6
+struct HudField {
+    uint8_t x, y, digits;      // digits is 0 if the field isn't in use
+    bool changed;              // value may differ from what's shown
+    int16_t value;
+    char shown[HUDMAXDIGITS];  // 0 where nothing has been drawn yet
+};
+static HudField hud[ABERLED_HUDSLOTS];
+
+// write value into s, right aligned in n characters. If it doesn't fit, it
+// becomes the biggest number which does.
+static void formatHud(char *s, uint8_t n, int16_t value){
+    uint16_t v = value < 0 ? 0u - (uint16_t)value : value;
+    uint8_t i = n;
+    do {
+        s[--i] = '0' + v % 10;
+        v /= 10;
+    } while(v && i);
+    if(value < 0){
+        if(i)
+            s[--i] = '-';
+        else
+            v = 1;  // no room for the sign
+    }
+    if(v){
+        memset(s, '9', n);
+        if(value < 0 && n > 1)
+            s[0] = '-';
+        return;
+    }
+    while(i)
+        s[--i] = ' ';
+}
+
+static void renderHud(){
+    bool burst = false;
+    for(uint8_t slot=0;slot<ABERLED_HUDSLOTS;slot++){
+        HudField *f = hud + slot;
+        if(!f->changed)
+            continue;
+        f->changed = false;
+        char s[HUDMAXDIGITS];
+        formatHud(s, f->digits, f->value);
+        for(uint8_t i=0;i<f->digits;i++){
+            if(s[i] == f->shown[i])
+                continue;
+            // keep the interrupt away from the TFT, as in renderText()
+            if(!burst && !asyncTFT){
+                tftBusy = true;
+                tft.beginBurst();
+                burst = true;
+            }
+            tftDrawChar(f->x + 6*i, f->y, s[i], TFT_WHITE, TFT_BLACK);
+            f->shown[i] = s[i];
+        }
+    }
+    if(burst){
+        tft.endBurst();
+        tftBusy = false;
+    }
+}
+
+
+// draw the whole front buffer to the TFT in one go. Each row with changed cells
+// gets a single window, spanning the first to the last changed cell, and the
+// pixels are streamed into it - including the black gaps between the cells,
+// so we don't have to set a new window for every cell. Tiles each need their
+// own window, so those are drawn a cell at a time.
+static void blitFrame(){
+    tft.beginBurst();
+    for(int y=0;y<8;y++){
+        uint16_t v = frontBuffer[y];
+        uint16_t changed = fullRefresh ? 0xffff : v ^ shownBuffer[y];
+        if(!changed)
+            continue;
+        shownBuffer[y] = v;
+
+        int16_t top = cellY(y);
+        if(tileSheet){
+            drawCellRow<uint16_t>(2, top, 16, 12, v, changed);
+            continue;
+        }
+
+        int x0 = 0;
+        while(!(changed & (3 << (x0*2))))
+            x0++;
+        int x1 = 7;
+        while(!(changed & (3 << (x1*2))))
+            x1--;
+
+        tft.setAddrWindow(16*x0+2, top, 16*x1+13, top+11);
+        for(int line=0;line<12;line++){
+            for(int x=x0;x<=x1;x++){
+                tft.pushColor(cols[(v >> (x*2)) & 3], 12);
+                if(x<x1)
+                    tft.pushColor(TFT_BLACK, 4);
+            }
+        }
+    }
+    tft.endBurst();
+}
+
+// using a TFT, so we draw rectangles instead of using the shift registers (which
+// don't exist on the TFT boards)
+inline void TFTDisplay::refreshRow(int row)
+{
+    tft.beginBurst();
+    drawChangedCells(row);
+    tft.endBurst();
+}
+
+// draw some queued operations or the next row, unless swap() is doing all
+// the drawing or the main code is currently using the TFT
+inline bool TFTDisplay::tick()
+{
+    if(asyncTFT)
+        tft.runQueue(QUEUECELLSPERTICK);
+    else if(!blitOnSwap && !tftBusy)
+        refreshNextRow();
+    else
+        return false;
+    return true;
+}
+
+void TFTDisplay::refreshAll()
+{
+    if(blitOnSwap)
+        blitFrame();
+    else if(asyncTFT){
+        // the interrupt empties the queue, so only wait for it - running the
+        // queue here as well would share the SPI bus and the queue with it.
+        // If the sketch has turned the interrupt off (as the bench does to
+        // time this), there's nothing else to do it.
+        if((TIMSK1 & (1 << OCIE1A)) && (SREG & (1 << SREG_I))){
+            while(tft.queued())
+                IDLE();
+        } else {
+            while(tft.queued())
+                tft.runQueue(QUEUECELLSPERTICK);
+        }
+    } else
+        refreshAllRows();
+}
+
+// move the picture on the TFT down by a row for each scrollDown(), with the
+// hardware scrolling rather than by redrawing it, and move shownBuffer to
+// match. Then only the new top row and whatever else really has changed
+// needs to be drawn.
+static void scrollGrid(){
+    // keep the interrupt from drawing a row until the TFT has caught up
+    // (in asynchronous mode it only draws what's queued, which is fine)
+    if(!asyncTFT)
+        tftBusy = true;
+
+    for(;scrollPending;scrollPending--){
+        uint16_t bottom = shownBuffer[7];
+        memmove(shownBuffer + 1, shownBuffer, 14);
+        shownBuffer[0] = bottom; // the bottom row wraps round to the top
+        scrollRows = (scrollRows + 1) & 7;
+    }
+    uint8_t offset = ((8 - scrollRows) & 7) * 16;
+
+    // the scroll has to happen in order with the queued cells, which are
+    // drawn at where their rows were when they were queued
+    if(asyncTFT){
+        while(!tft.queueScroll(offset)){
+            IDLE();
+        }
+    } else {
+        tft.scrollTo(offset);
+        tftBusy = false;
+    }
+}
+
+void TFTDisplay::swapped()
+{
+    if(scrollPending)
+        scrollGrid();
+
+    // render text to the screen if it has changed. This is done with interrupts
+    // enabled, because it can take a while.
+    renderText();
+    renderHud();
+
+    // in this mode the interrupt doesn't touch the TFT, so we can draw with
+    // interrupts enabled
+    if(blitOnSwap)
+        blitFrame();
+    // in this mode we just queue the changes, and the interrupt will draw them
+    else if(asyncTFT){
+        for(int y=0;y<8;y++)
+            drawChangedCells(y);
+    }
+}
+
+bool TFTDisplay::frameReady()
+{
+    // if swap() draws the frame, it's already on the display by the time swap() returns
+    if(blitOnSwap)
+        return true;
+    if(asyncTFT)
+        return !tft.queued();
+    return rowsDrawn >= 8;
+}
+
+void TFTDisplay::setupTimer()
+{
+    // 200 Hz
+    msPerTick = 5;
+    OCR1A = 1249;
+    TCCR1B |= (1 << WGM12);
+    TCCR1B |= (1 << CS11) | (1 << CS10);
+}
+#endif
+
+// called from swapAsync() with how long the interrupt has been busy for
+// since the last swap, to turn the refresh rate down if it's using too
+// much of the CPU or back up if there's room. This is done over a few
+// frames at a time so a single slow or quick frame doesn't change it.
+
+static void adaptRefresh(uint32_t busy, int ticks)
+{
+    if (!maxInterruptLoad)
+        return;
+    adaptBusy += busy;
+    adaptTicks += ticks;
+    if (adaptTicks < ADAPTTICKS)
+        return;
+
+    // the interrupt's share of the time, in percent
+    uint32_t total = (uint32_t)(OCR1A + 1) * adaptTicks;
+    byte load = adaptBusy * 100 / total;
+    adaptBusy = 0;
+    adaptTicks = 0;
+
+    byte d = refreshDivider;
+    if (load > maxInterruptLoad && d < MAXREFRESHDIVIDER)
+        d++;
+    else if (load < maxInterruptLoad / 2 && d > baseRefreshDivider)
+        d--;
+    refreshDivider = d;
+}
+
+int AberLEDClass::setRefreshRate(int hz)
+{
+    if (!msPerTick) // begin() hasn't been called
+        return 0;
+    int tickRate = 1000 / msPerTick;
+    int d = hz > 0 ? (tickRate + hz / 2) / hz : MAXREFRESHDIVIDER;
+    baseRefreshDivider = constrain(d, 1, MAXREFRESHDIVIDER);
+    refreshDivider = baseRefreshDivider;
+    return tickRate / baseRefreshDivider;
+}
+
+int AberLEDClass::getRefreshRate()
+{
+    return msPerTick ? 1000 / msPerTick / refreshDivider : 0;
+}
+
+void AberLEDClass::setAdaptiveRefresh(byte maxLoad)
+{
+    maxInterruptLoad = maxLoad;
+    adaptBusy = 0;
+    adaptTicks = 0;
+    if (!maxLoad)
+        refreshDivider = baseRefreshDivider;
+}
 
 // The user calls this code when they have finished writing to
 // the back buffer. It swaps the back and front buffer, so that
 // the newly written buffer becomes the front buffer and is
 // displayed. This is done by swapping the pointers, not the data.
 // Interrupts are disabled to avoid the "tearing" effect produced
-// by the buffers being swapped during redraw.
+// by the buffers being swapped during redraw. This version returns
+// immediately; swap() below also waits for the interrupt.
 
-void AberLEDClass::swap()
+void AberLEDClass::swapAsync()
 {
     uint16_t *t;
 
     cli();
-    for (int i = 0; i < 5; i++)
-    {
-        buttonWentDownInLastLoop[i] = buttonWentDown[i];
-        buttonWentDown[i] = 0;
-        buttonStates[i] = debouncedButtonStates[i];
-    }
+    buttonWentDownInLastLoop = buttonWentDown;
+    buttonWentDown = 0;
+    buttonStates = debouncedButtonStates;
 
     ticks = interruptTicks;
     interruptTicks = 0;
+    uint32_t busy = interruptBusy;
+    interruptBusy = 0;
 
     t = frontBuffer;
     frontBuffer = backBuffer;
     backBuffer = t;
-
-    // render text to the screen if it has changed. Will do nothing if not using a TFT.
-    if(isTFT)
-        renderText();
+    rowsDrawn = 0;
+#if USEBCM
+    uint16_t (*l)[4] = levelFront;
+    levelFront = levelBack;
+    levelBack = l;
+#endif
 
     sei();
+
+#if ABERLED_TRACE
+    // take this frame's input from the recording, or record it
+    if (replayStream)
+        replayFrame();
+    else if (recording)
+    {
+        byte n = ticks < 7 ? ticks : 7;
+        libraryTrace(TRACE_FRAME, buttonWentDownInLastLoop | (n << 5));
+        if (n == 7)
+            libraryTrace(TRACE_TICKS, ticks < 255 ? ticks : 255);
+    }
+#endif
+
     if (interruptRunning)
     {
+        frameTime += (unsigned long)ticks * msPerTick;
+        adaptRefresh(busy, ticks);
+    }
+    else
+        frameTime = millis();
+
+    // let the display draw the new frame, or start to (on the TFT, this also
+    // draws the text if it has changed)
+    Display::swapped();
+
+#if ABERLED_TRACE
+    // send some of the trace log, if there is any
+    AberLED.flushTrace();
+#endif
+}
+
+void AberLEDClass::swap()
+{
+    swapAsync();
+    if (interruptRunning && !noWait && !isReplaying())
+    {
+#if ABERLED_STATS
+        unsigned long start = micros();
+#endif
         while (interruptTicks < 2)
         {
+            IDLE();
+        }
+#if ABERLED_STATS
+        recordTime(AT_SWAPWAIT, micros() - start);
+#endif
+    }
+}
+
+bool AberLEDClass::usingTFT()
+{
+    return isTFT;
+}
+
+void AberLEDClass::setHudField(byte slot, byte x, byte y, byte digits)
+{
+#if ABERLED_DISPLAY != ABERLED_LED
+    if(!isTFT || slot >= ABERLED_HUDSLOTS)
+        return;
+    HudField *f = hud + slot;
+    f->x = x;
+    f->y = y;
+    f->digits = min(digits, HUDMAXDIGITS);
+    memset(f->shown, 0, HUDMAXDIGITS);
+    f->changed = f->digits != 0;
+#endif
+}
+
+void AberLEDClass::setHudNumber(byte slot, int value)
+{
+#if ABERLED_DISPLAY != ABERLED_LED
+    if(!isTFT || slot >= ABERLED_HUDSLOTS)
+        return;
+    HudField *f = hud + slot;
+    if(f->digits && value != f->value){
+        f->value = value;
+        f->changed = true;
+    }
+#endif
+}
+
+void AberLEDClass::setTiles(const uint8_t *sheet)
+{
+#if ABERLED_DISPLAY != ABERLED_LED
+    if(!isTFT)
+        return;
+    cli();
+    tileSheet = sheet;
+    tft.setTiles(sheet, tilePalettes);
+    // make every cell look changed, so they're all redrawn
+    for(int y=0;y<8;y++)
+        shownBuffer[y] = ~frontBuffer[y];
+    sei();
+#endif
+}
+
+void AberLEDClass::drawCells(int16_t x, int16_t y, uint8_t pitch, uint8_t size,
+                             uint32_t bits, uint32_t changed)
+{
+#if ABERLED_DISPLAY != ABERLED_LED
+    if(!isTFT)
+        return;
+    // keep the interrupt away from the TFT, as in renderText()
+    if(!asyncTFT){
+        tftBusy = true;
+        tft.beginBurst();
+    }
+    drawCellRow<uint32_t>(x, y, pitch, size, bits, changed);
+    if(!asyncTFT){
+        tft.endBurst();
+        tftBusy = false;
+    }
+#endif
+}
+
+void AberLEDClass::scrollDown()
+{
+#if ABERLED_DISPLAY != ABERLED_LED
+    if(isTFT)
+        scrollPending++;
+#endif
+}
+
+bool AberLEDClass::isFrameReady()
+{
+    // if there's no interrupt, refresh() draws the whole frame at once
+    if(!interruptRunning)
+        return true;
+    return Display::frameReady();
+}
+
+void AberLEDClass::waitForFrame()
+{
+    while(!isFrameReady())
+    {
+        IDLE();
+    }
+}
+
+int AberLEDClass::addTask(void (*fn)(), uint16_t period)
+{
+    if (numTasks == ABERLED_TASKS)
+        return -1;
+    Task *t = tasks + numTasks;
+    t->fn = fn;
+    t->period = period ? period : 1;
+    t->running = false;
+    return numTasks++;
+}
+
+void AberLEDClass::startTask(int task, unsigned long now, uint16_t period)
+{
+    if (task < 0 || task >= numTasks)
+        return;
+    Task *t = tasks + task;
+    if (period)
+        t->period = period;
+    t->due = now + t->period;
+    t->running = true;
+}
+
+void AberLEDClass::setTaskPeriod(int task, uint16_t period)
+{
+    if (task < 0 || task >= numTasks || !period)
+        return;
+    Task *t = tasks + task;
+    // runTasks() has already added the old period on to the last run. This
+    // is done in unsigned long - period - t->period would be an unsigned int,
+    // which wraps on the board when the period gets shorter.
+    t->due = t->due - t->period + period;
+    t->period = period;
+}
+
+void AberLEDClass::stopTask(int task)
+{
+    if (task >= 0 && task < numTasks)
+        tasks[task].running = false;
+}
+
+void AberLEDClass::stopTasks()
+{
+    for (byte i = 0; i < numTasks; i++)
+        tasks[i].running = false;
+}
+
+void AberLEDClass::runTasks(unsigned long now)
+{
+    for (;;)
+    {
+        // find the task which has been due the longest - the first one
+        // added, if several have been due as long
+        Task *next = NULL;
+        long late = -1;
+        for (Task *t = tasks; t < tasks + numTasks; t++)
+        {
+            long l = now - t->due;
+            if (t->running && l > late)
+            {
+                next = t;
+                late = l;
+            }
         }
+        if (!next)
+            return;
+        // drop the runs which are too far behind to be worth catching up
+        long behind = late / next->period;
+        if (behind >= MAXCATCHUP)
+            next->due += (behind - (MAXCATCHUP - 1)) * next->period;
+        // step on before running the task, so that it can restart itself
+        next->due += next->period;
+        next->fn();
+    }
+}
+
+void AberLEDClass::idleUntilTask()
+{
+    if (!interruptRunning || isReplaying())
+        return;
+    // how long after the last swap the soonest task is due
+    bool any = false;
+    long wait = 0;
+    for (Task *t = tasks; t < tasks + numTasks; t++)
+    {
+        long d = t->due - frameTime;
+        if (t->running && (!any || d < wait))
+        {
+            wait = d;
+            any = true;
+        }
+    }
+    if (!any)
+        return;
+    while ((long)interruptTicks * msPerTick < wait &&
+           debouncedButtonStates == buttonStates && !buttonWentDown)
+    {
+        SLEEP();
     }
 }
 
@@ -311,6 +1579,17 @@ void AberLEDClass::addToText(const char *s){
     }
 }
 
+void AberLEDClass::addToText(const __FlashStringHelper *s){
+    if(isTFT){
+        const char *p = (const char *)s;
+        cli();
+        if(strlen(txtBuffer) + strlen_P(p) + 1 < MAXTEXTLEN){
+            strcat_P(txtBuffer, p);
+        }
+        sei();
+    }
+}
+
 void AberLEDClass::addToText(int n){
     // write the number to a temporary string, taking care not to overflow the buffer.
     char tmp[16];
@@ -320,12 +1599,238 @@ void AberLEDClass::addToText(int n){
 
 int AberLEDClass::getButton(unsigned char c)
 {
-    return buttonStates[c - 1];
+    return (buttonStates >> (c - 1)) & 1;
 }
 
 int AberLEDClass::getButtonDown(unsigned char c)
 {
-    return buttonWentDownInLastLoop[c - 1];
+    return (buttonWentDownInLastLoop >> (c - 1)) & 1;
+}
+
+bool AberLEDClass::pollEvent(AberLEDEvent *e)
+{
+    if (eventTail == eventHead)
+        return false;
+    *e = eventQueue[eventTail];
+    eventTail = (eventTail + 1) & (EVENTQUEUESIZE - 1);
+    return true;
+}
+
+uint16_t AberLEDClass::getLostEvents()
+{
+    cli();
+    uint16_t n = lostEvents;
+    sei();
+    return n;
+}
+
+uint16_t AberLEDClass::getTickCount()
+{
+    cli();
+    uint16_t t = tickCount;
+    sei();
+    return t;
+}
+
+#if ABERLED_TRACE
+static void addTrace(byte id, byte arg)
+{
+    // if we've lost some records, say so before anything else
+    if (traceLost && storeTrace(TRACE_LOST, traceLost))
+        traceLost = 0;
+    if (traceLost || !storeTrace(id, arg))
+    {
+        if (traceLost != 0xff)
+            traceLost++;
+    }
+}
+
+static void libraryTrace(byte id, byte arg)
+{
+    if (tracing)
+        addTrace(id, arg);
+}
+
+void AberLEDClass::trace(uint8_t id, uint8_t arg)
+{
+    tracing = true;
+    addTrace(id, arg);
+}
+
+void AberLEDClass::flushTrace()
+{
+    if (!tracing)
+        return;
+    while (traceTail != traceHead && Serial.availableForWrite() >= 6)
+    {
+        TraceRecord *r = traceBuffer + traceTail;
+        byte b[6];
+        b[0] = TRACESYNC;
+        b[1] = r->id;
+        b[2] = r->arg;
+        b[3] = r->delta & 0xff;
+        b[4] = r->delta >> 8;
+        b[5] = b[1] ^ b[2] ^ b[3] ^ b[4];
+        Serial.write(b, 6);
+        traceTail = (traceTail + 1) & (ABERLED_TRACESIZE - 1);
+    }
+}
+#endif
+
+#if ABERLED_TRACE
+void AberLEDClass::startRecording(uint16_t seed)
+{
+    trace(TRACE_SEED, seed & 0xff);
+    trace(TRACE_SEED, seed >> 8);
+    recording = true;
+}
+
+// Read the next good trace record from the replay stream, putting its id and
+// argument into r. Returns false if nothing has arrived for a second.
+static bool readRecord(byte *r)
+{
+    byte buf[6];
+    byte n = 0;
+    unsigned long last = millis();
+    for (;;)
+    {
+        if (!replayStream->available())
+        {
+            if (millis() - last > 1000)
+                return false;
+            IDLE();
+            continue;
+        }
+        last = millis();
+        buf[n++] = replayStream->read();
+        if (n == 6)
+        {
+            if ((buf[1] ^ buf[2] ^ buf[3] ^ buf[4]) == buf[5])
+            {
+                r[0] = buf[1];
+                r[1] = buf[2];
+                return true;
+            }
+            // not really a record, so look for the next sync byte after this one
+            memmove(buf, buf + 1, --n);
+        }
+        while (n && buf[0] != TRACESYNC)
+            memmove(buf, buf + 1, --n);
+    }
+}
+
+// stop replaying, going back to the real buttons
+static void stopReplay()
+{
+    replayStream = NULL;
+}
+
+uint16_t AberLEDClass::startReplay(Stream &in)
+{
+    replayStream = &in;
+    uint16_t seed = 0;
+    byte r[2], got = 0;
+    while (got < 2)
+    {
+        if (!readRecord(r))
+        {
+            stopReplay();
+            break;
+        }
+        if (r[0] == TRACE_SEED)
+            seed |= (uint16_t)r[1] << (8 * got++);
+    }
+    return seed;
+}
+
+bool AberLEDClass::isReplaying()
+{
+    return replayStream != NULL;
+}
+
+// read the next frame from the recording, and use it instead of what
+// the interrupt saw
+static void replayFrame()
+{
+    byte r[2];
+    do
+    {
+        if (!readRecord(r))
+        {
+            stopReplay();
+            return;
+        }
+    } while (r[0] != TRACE_FRAME);
+
+    buttonWentDownInLastLoop = buttonStates = r[1] & 0x1f;
+    ticks = r[1] >> 5;
+    if (ticks == 7 && readRecord(r) && r[0] == TRACE_TICKS)
+        ticks = r[1];
+}
+#endif
+
+#if ABERLED_STATS
+void AberLEDClass::getFrameStats(AberLEDTiming *out)
+{
+    cli();
+    memcpy(out, stats, sizeof(stats));
+    sei();
+}
+
+void AberLEDClass::resetFrameStats()
+{
+    cli();
+    memset(stats, 0, sizeof(stats));
+    for (int i = 0; i < AT_COUNT; i++)
+        stats[i].min = 0xffff;
+    sei();
+}
+
+void AberLEDClass::addTiming(AberLEDTimer timer, unsigned long us)
+{
+    // the interrupt writes its own timers, so we can't safely write those
+    if (timer != AT_ISR && timer != AT_REFRESH && timer < AT_COUNT)
+        recordTime(timer, us);
+}
+#endif
+
+void AberLEDClass::memoryReport(AberLEDMemory *m)
+{
+#if ABERLED_HOST
+    m->freeNow = m->freeLow = m->staticData = 0;
+#else
+    char here;
+    char *p = heapEnd();
+    m->freeNow = &here - p;
+    m->freeLow = 0;
+    for (; p < &here && *p == STACKPAINT; p++)
+        m->freeLow++;
+    m->staticData = &__heap_start - &__data_start;
+#endif
+    m->frameBuffers = sizeof(bufferA) + sizeof(bufferB);
+#if USEBCM
+    m->frameBuffers += sizeof(levelsA) + sizeof(levelsB);
+#endif
+    m->text = sizeof(txtBuffer) + sizeof(prevTxtBuffer);
+#if ABERLED_DISPLAY != ABERLED_LED
+    m->frameBuffers += sizeof(shownBuffer);
+    m->text += sizeof(hud);
+    m->tft = sizeof(tft);
+#else
+    m->tft = 0;
+#endif
+    m->input = sizeof(buttonMap) + sizeof(eventQueue);
+#if ABERLED_TRACE
+    m->trace = sizeof(traceBuffer);
+#else
+    m->trace = 0;
+#endif
+#if ABERLED_STATS
+    m->stats = sizeof(stats);
+#else
+    m->stats = 0;
+#endif
+    m->tasks = sizeof(tasks);
 }
 
 // The user calls this before writing to the back buffer, to
@@ -351,64 +1856,105 @@ void AberLEDClass::set(int x, int y, unsigned char col)
     }
 }
 
-// sets the entire back buffer to zero
+// row and rectangle writes to the back buffer
 
-void AberLEDClass::clear()
+void AberLEDClass::setRow(int y, uint16_t bits)
 {
-    memset(backBuffer, 0, 16);
+    if (y < 8 && y >= 0)
+        backBuffer[y] = bits;
 }
 
+void AberLEDClass::blitRows(const uint16_t *rows, int first, int count)
+{
+    for (int i = 0; i < count; i++, first++)
+    {
+        if (first < 8 && first >= 0)
+            backBuffer[first] = rows[i];
+    }
+}
 
-// called periodically by the interrupt, this writes the front
-// buffer data out to the screen. The front buffer is the one
-// which is not being drawn to.
-
-static int refrow = 0;
-inline void refreshNextRow()
+void AberLEDClass::fillRect(int x, int y, int w, int h, unsigned char col)
 {
-    if(isTFT) {
-        // using a TFT, so we draw rectangles instead of using the shift registers (which
-        // don't exist on the TFT boards)
+    // clip to the buffer
+    if (x < 0)
+    {
+        w += x;
+        x = 0;
+    }
+    if (y < 0)
+    {
+        h += y;
+        y = 0;
+    }
+    if (x + w > 8)
+        w = 8 - x;
+    if (y + h > 8)
+        h = 8 - y;
+    if (w <= 0 || h <= 0)
+        return;
+
+    // work out which bits of each row we are changing, and what to put there -
+    // the colour repeated across the whole row.
+    uint16_t mask = (w == 8 ? 0xffff : (1u << (w * 2)) - 1) << (x * 2);
+    uint16_t bits = (col & 3) * 0x5555u & mask;
+    for (uint16_t *p = backBuffer + y; h--; p++)
+        *p = (*p & ~mask) | bits;
+}
 
-        uint16_t v = *(frontBuffer + refrow); // get row pointer
-//        uint16_t vold = *(backBuffer + refrow); // get row pointer
+void AberLEDClass::hline(int x, int y, int w, unsigned char col)
+{
+    fillRect(x, y, w, 1, col);
+}
 
-        for(int x=0;x<8;x++){
-            uint16_t q = (v >> (x*2)) & 3;
-            tft.fillRect(16*x+2, 16*refrow+2, 12, 12, cols[q]);
-        }
-    } else {
-        // this code is used for the older LED boards, and use the shift registers -
-        // we directly manipulate the port registers for speed.
+void AberLEDClass::vline(int x, int y, int h, unsigned char col)
+{
+    fillRect(x, y, 1, h, col);
+}
 
-        if (!refrow)
-            PORTD |= 1 << 2; // turn on the row data line to get the first bit set
+// set the bit of each plane for the two LEDs of a pixel from the bits of
+// their levels
 
-        // set latches low
-        PORTD &= ~((1 << 3) | (1 << 7));
+void AberLEDClass::setLevel(int x, int y, uint8_t red, uint8_t green)
+{
+#if USEBCM
+    if (x < 8 && y < 8 && x >= 0 && y >= 0)
+    {
+        uint16_t *p = levelBack[y];
+        uint16_t g = 1u << (x * 2), r = g << 1;
+        for (byte i = 0; i < 4; i++, red >>= 1, green >>= 1)
+            p[i] = (p[i] & ~(g | r)) | (green & 1 ? g : 0) | (red & 1 ? r : 0);
+    }
+#endif
+}
 
-        // tick the row clock to move the next bit in (high on
-        // the first row, low after that)
-        PORTD |= (1 << 4);
-        PORTD &= ~(1 << 4);
+// sets the entire back buffer to zero
 
-        // and turn off the row data line
-        PORTD &= ~(1 << 2);
+void AberLEDClass::clear()
+{
+    memset(backBuffer, 0, 16);
+#if USEBCM
+    if (bcm)
+        memset(levelBack, 0, sizeof(levelsA));
+#endif
+}
 
-        // now the appropriate row is set high, set the column
-        // bits low for the pixels we want.
 
-        fastShiftOutCols(~(frontBuffer[refrow]));
-        // and latch the registers
+// called periodically by the interrupt, this writes the front
+// buffer data out to the screen. The front buffer is the one
+// which is not being drawn to.
 
-        PORTD |= ((1 << 3) | (1 << 7));
-    }
+static int refrow = 0;
+inline void refreshNextRow()
+{
+    Display::refreshRow(refrow);
 
     refrow = (refrow + 1) % 8;
+    if(rowsDrawn < 8)
+        rowsDrawn++;
 }
 
-// refresh the entire display BY HAND. This IS NOT CALLED BY THE INTERRUPT!!!!
-void AberLEDClass::refresh()
+// send all the rows of the front buffer to the display, in order
+static void refreshAllRows()
 {
     refrow = 0;
     refreshNextRow();
@@ -419,95 +1965,107 @@ void AberLEDClass::refresh()
     refreshNextRow();
     refreshNextRow();
     refreshNextRow();
+}
 
-    if(!isTFT){
-        // hold the last line for a little while
-        for (int volatile i = 0; i < 30; i++)
-        {
-            __asm__ __volatile__("nop\n\t");
-        }
+// refresh the entire display BY HAND. This IS NOT CALLED BY THE INTERRUPT!!!!
+void AberLEDClass::refresh()
+{
+    Display::refreshAll();
+}
 
-        //    // latch off values into the columns, to avoid last row bright.
-        PORTD &= ~((1 << 3) | (1 << 7));
-        fastShiftOutCols(0xffff);
-        PORTD |= ((1 << 3) | (1 << 7));
-    }
+// the timer 1 counts since start, in an interrupt. The timer goes back to 0
+// at OCR1A, so if it has done that meanwhile - the interrupt has run past its
+// own period, which is just what the statistics are there to catch - the
+// difference needs the period adding back on.
+static inline uint16_t timerSince(uint16_t start)
+{
+    uint16_t took = TCNT1 - start;
+    if ((int16_t)took < 0)
+        took += OCR1A + 1;
+    return took;
 }
 
 // this is the interrupt service routine for the timer interrupt
 
 ISR(TIMER1_COMPA_vect)
 {
+    // TCNT1 - start at the end is how long we took, for the statistics and
+    // adaptive refresh
+    uint16_t start = TCNT1;
     interruptTicks++;
+    tickCount++;
 
-    // draw the next row
-    refreshNextRow();
-
-    static byte trueButtonStates[] = {0, 0, 0, 0, 0};
-    static byte button = 0;
-    // and process the next button
-
-    byte bstate;
-    if (boardRev == REV00)
+    // do the display's drawing, if this is one of the ticks which does
+    static byte refreshCount = 0;
+    if (++refreshCount >= refreshDivider)
     {
-        switch (button)
-        {
-        case 0:
-            bstate = PINC & 2;
-            break;
-        case 1:
-            bstate = PINC & 1;
-            break;
-        case 2:
-            bstate = PINC & 4;
-            break;
-        case 3:
-            bstate = PINC & 8;
-            break;
-        case 4:
-            bstate = PINB & 2;
-            break;
-        }
+        refreshCount = 0;
+#if ABERLED_STATS
+        if (Display::tick())
+            recordTime(AT_REFRESH, timerToMicros(timerSince(start)));
+#else
+        Display::tick();
+#endif
     }
-    else
+
+    // and read all the buttons. Each bit of these is a button, and the debounce
+    // counts are "vertical" 2-bit counters - count0 holds the low bit for every
+    // button and count1 the high bit, so all five can be counted at once.
+    static byte lastSample = 0;
+    static byte count0 = 0, count1 = 0;
+
+    byte sample = buttonMap[(PINC & 0x0f) | ((PINB & 2) << 3)];
+
+    // a press is reported as soon as it is seen
+    buttonWentDown |= sample & ~lastSample;
+    lastSample = sample;
+
+    // the debounced state of a button changes once it has been different
+    // for 4 ticks in a row; the count restarts whenever it isn't.
+    byte delta = sample ^ debouncedButtonStates;
+    count1 = (count1 ^ count0) & delta;
+    count0 = ~count0 & delta;
+    byte changed = delta & ~(count0 | count1);
+    debouncedButtonStates ^= changed;
+
+    // queue an event for each debounced change
+    for (byte i = 0; changed; i++, changed >>= 1)
     {
-        switch (button)
+        if (changed & 1)
         {
-        case 0:
-            bstate = PINC & 1;
-            break;
-        case 1:
-            bstate = PINC & 8;
-            break;
-        case 2:
-            bstate = PINC & 4;
-            break;
-        case 3:
-            bstate = PINC & 2;
-            break;
-        case 4:
-            bstate = PINB & 2;
-            break;
+            byte next = (eventHead + 1) & (EVENTQUEUESIZE - 1);
+            if (next == eventTail)
+            {
+                lostEvents++; // the queue is full
+                continue;
+            }
+            AberLEDEvent *e = eventQueue + eventHead;
+            e->button = i + 1;
+            e->down = (debouncedButtonStates >> i) & 1;
+            e->tick = tickCount;
+            // make sure the event is stored before pollEvent() can see it
+            asm volatile("" ::: "memory");
+            eventHead = next;
         }
     }
+    uint16_t took = timerSince(start);
+    interruptBusy += took;
+#if ABERLED_STATS
+    recordTime(AT_ISR, timerToMicros(took));
+#endif
+}
 
-    bstate = bstate ? 0 : 1; // make booleanesque and invert
-
-    if (bstate != trueButtonStates[button])
-    {
-        buttonDebounceCounters[button] = 0;
-        if (bstate)
-            buttonWentDown[button] = 1;
-    }
-    else if (++buttonDebounceCounters[button] == 4)
-    {
-        buttonDebounceCounters[button] = 0;
-        debouncedButtonStates[button] = bstate;
-    }
-    trueButtonStates[button] = bstate;
+#if USEBCM
+// the rest of each row's planes for AF_BCM. This counts towards the load
+// seen by adaptive refresh, but not the AT_ISR statistics.
 
-    button = (button + 1) % 5;
+ISR(TIMER1_COMPB_vect)
+{
+    uint16_t start = TCNT1;
+    LEDDisplay::nextPlane();
+    interruptBusy += timerSince(start);
 }
+#endif
 
 // Set up a 1kHz interrupt handler - the code for the interrupt
 // is in the TIMER1_COMPA_vect() function.
@@ -523,20 +2081,7 @@ static void setupInterrupt()
     TCCR1A = 0; // set entire TCCR1A register to 0
     TCCR1B = 0; // same for TCCR1B
     TCNT1 = 0;  // initialize counter value to 0
-    if(isTFT) {
-        // 200 Hz
-        OCR1A = 1249;
-        TCCR1B |= (1 << WGM12);
-        TCCR1B |= (1 << CS11) | (1 << CS10);
-    } else {
-        // set compare match register for correct frequency
-        // (16*10^6) / (500*8) - 1 gives 3999 (for 500Hz)
-        OCR1A = 3999;
-        // turn on CTC mode
-        TCCR1B |= (1 << WGM12);
-        // Set prescaler to 8
-        TCCR1B |= (1 << CS11);
-    }
+    Display::setupTimer();
     // enable timer compare interrupt
     TIMSK1 |= (1 << OCIE1A);
     interruptRunning = true;
@@ -16,6 +16,7 @@
 #define __ABERLED_H
 
 #include "Arduino.h"
+#include "AberLED_Setup.h"
 
 /// the "off" colour for pixels, used in set()
 #define BLACK 0
@@ -53,9 +54,130 @@ enum AberLEDFlags {
     AF_TFTDISPLAY = 2,
     /// Do not set up the interrupt. The screen will not be refreshed
     /// automatically. You will need to do by calling refresh() often.
-    AF_NOINTERRUPT = 4
+    AF_NOINTERRUPT = 4,
+    /// On a TFT display, redraw every cell on every refresh instead of only
+    /// the cells which have changed since they were last drawn
+    AF_FULLREFRESH = 8,
+    /// On a TFT display, draw the changed parts of the frame in swap() instead
+    /// of a row at a time in the interrupt, which will then only read the buttons.
+    AF_BLITONSWAP = 16,
+    /// Make swap() return immediately, like swapAsync(), rather than waiting
+    /// for the interrupt. Use isFrameReady() to pace the loop yourself.
+    AF_NOWAIT = 32,
+    /// On a TFT display, make swap() queue the changed cells and return,
+    /// leaving the interrupt to draw a row's worth of them every tick. Each
+    /// changed row is one entry in the queue, so a whole frame fits; text is
+    /// queued a character at a time. swap() only waits if the queue is full.
+    AF_ASYNCTFT = 64,
+    /// On a TFT display, draw each cell as a shaded 12x12 tile - a ship, a
+    /// red brick or a riveted yellow block - instead of a flat square.
+    /// See setTiles() to use your own.
+    AF_TILES = 128,
+    /// On an LED display, show each LED at one of 16 brightnesses, set with
+    /// setLevel(). Needs the interrupt, and ABERLED_BCM in AberLED_Setup.h.
+    AF_BCM = 256
 };
 
+/// Combine flags, e.g. `AberLED.begin(AF_TFTDISPLAY | AF_FULLREFRESH)`
+inline AberLEDFlags operator|(AberLEDFlags a, AberLEDFlags b) {
+    return (AberLEDFlags)((int)a | (int)b);
+}
+
+/// A button press or release, as returned by AberLEDClass::pollEvent().
+struct AberLEDEvent {
+    /// the button code (compare with UP, DOWN, LEFT, RIGHT or FIRE)
+    uint8_t button;
+    /// true if the button was pressed, false if it was released
+    bool down;
+    /// the value of getTickCount() when the change was detected (after debouncing)
+    uint16_t tick;
+};
+
+/// The things timed by the statistics - see AberLEDClass::getFrameStats().
+/// The first four are timed by the library, the others are for the sketch
+/// to time with addTiming() or ABERLED_TIMED().
+enum AberLEDTimer {
+    /// the whole interrupt handler
+    AT_ISR,
+    /// drawing done by the interrupt: refreshNextRow() or the TFT queue
+    AT_REFRESH,
+    /// time spent in swap() waiting for the interrupt
+    AT_SWAPWAIT,
+    /// drawing the text area, when the text has changed
+    AT_TEXT,
+    /// the sketch's input handling
+    AT_INPUT,
+    /// the sketch's model update
+    AT_UPDATE,
+    /// the sketch's rendering (into the back buffer)
+    AT_RENDER,
+    /// the number of timers
+    AT_COUNT
+};
+
+/// the number of histogram buckets in AberLEDTiming
+#define AT_HISTBUCKETS 8
+
+/// Timing statistics for one of the AberLEDTimer slots. All times are
+/// in microseconds.
+struct AberLEDTiming {
+    /// the shortest and longest times
+    uint16_t min, max;
+    /// the sum of all the times, so the average is total/count
+    uint32_t total;
+    /// how many times have been recorded
+    uint16_t count;
+    /// how many times fell into each bucket. The buckets go up by a
+    /// factor of 4: under 8us, under 32us, under 128us and so on,
+    /// up to 32768us or more in the last one. These stop at 65535.
+    uint16_t hist[AT_HISTBUCKETS];
+};
+
+/// How RAM is being used, as filled in by AberLEDClass::memoryReport(). All
+/// the sizes are in bytes. The free RAM figures are 0 in the host build.
+struct AberLEDMemory {
+    /// the free RAM between the heap (or the static data, if malloc() has
+    /// never been used) and the stack, just now
+    uint16_t freeNow;
+    /// the least there has been since begin(), found from how far down the
+    /// stack has reached - the headroom the sketch really has
+    uint16_t freeLow;
+    /// all the static data of the sketch and its libraries together
+    uint16_t staticData;
+    /// the library's own buffers: the two frame buffers, the brightness
+    /// buffers for AF_BCM and the copy of what's on the TFT
+    uint16_t frameBuffers;
+    /// the text area's two buffers and the HUD fields
+    uint16_t text;
+    /// the button lookup table and the event queue
+    uint16_t input;
+    /// the tft object, including its drawing queue (0 without the TFT code)
+    uint16_t tft;
+    /// the trace log buffer (0 if ABERLED_TRACE is off)
+    uint16_t trace;
+    /// the timing statistics (0 if ABERLED_STATS is off)
+    uint16_t stats;
+    /// the scheduler's task table
+    uint16_t tasks;
+};
+
+/// Trace record ids from 0xf0 upwards are used by the library - sketches
+/// should use lower ones.
+/// A trace record for the text area changing - the argument is the new length.
+#define TRACE_TEXT 0xf0
+/// A trace record saying that some records were lost because the buffer was
+/// full - the argument is how many (up to 255).
+#define TRACE_LOST 0xf1
+/// Two trace records (low byte first) giving the random seed of a recording -
+/// see AberLEDClass::startRecording().
+#define TRACE_SEED 0xf2
+/// A trace record for each frame of a recording. The argument has the buttons which
+/// went down in bits 0-4 (button 1 in bit 0) and the number of interrupt ticks
+/// the frame took in bits 5-7. If that is 7, a TRACE_TICKS record follows.
+#define TRACE_FRAME 0xf3
+/// The number of ticks a long frame took, up to 255.
+#define TRACE_TICKS 0xf4
+
 /// The class for the AberLED shield. One object of this class, called
 /// **AberLED**, is automatically created (similar to how Serial works).
 /// Yes, all this time you've been writing C++, not C. You should put
@@ -103,6 +225,34 @@ public:
     /// displayed.
 
     void swap();
+
+    /// Like swap(), but returns as soon as the buffers have been exchanged
+    /// instead of waiting for the interrupt. The new front buffer will
+    /// be sent to the display by the interrupt over the next few ticks: use
+    /// isFrameReady() or waitForFrame() if you need to know when it's there.
+    /// Drawing and swapping again before then is allowed, but the display
+    /// may show part of one frame and part of the next.
+
+    void swapAsync();
+
+    /// Say that the frame being drawn is the one on the display moved down a
+    /// row, as when a game scrolls everything down. This doesn't change the back
+    /// buffer - draw the frame as usual. On a TFT, the next swap() then moves
+    /// the picture down with the display's hardware scrolling and only redraws
+    /// the new top row and any other cells which differ, instead of nearly
+    /// every cell. The text area isn't scrolled. On an LED display this does
+    /// nothing, as every row is sent each time anyway.
+
+    void scrollDown();
+
+    /// Return true if the whole of the front buffer has reached the display
+    /// since the last swap.
+
+    bool isFrameReady();
+
+    /// Wait until isFrameReady() is true.
+
+    void waitForFrame();
     
     /// This sets the given pixel in the back buffer to the given value.
     /// The pixel values are 0 (off), 1 (green), 2 (red) or 3 (yellow),
@@ -112,8 +262,75 @@ public:
     /// \param col the colour to use: BLACK, GREEN, RED or YELLOW.
     
     void set(int x, int y, unsigned char col);
+
+    /// Like set(), but without checking that x and y are in range - so
+    /// make sure they are! This is inline, so it's faster than set().
+    /// \param x the x coordinate of the pixel to write (0-7)
+    /// \param y the y coordinate of the pixel to write (0-7)
+    /// \param col the colour to use: BLACK, GREEN, RED or YELLOW.
+
+    inline void setFast(int x, int y, unsigned char col) {
+        uint16_t *p = backBuffer + y;
+        x *= 2;
+        *p = (*p & ~(3u << x)) | ((uint16_t)col << x);
+    }
+
+    /// Set a whole row of the back buffer at once, in the same format as
+    /// getBuffer() - 2 bits per pixel, with pixel 0 in the lowest bits.
+    /// Does nothing if y is out of range.
+    /// \param y the row to write (0-7)
+    /// \param bits the new contents of the row
+
+    void setRow(int y, uint16_t bits);
+
+    /// Copy several rows into the back buffer, in the same format as
+    /// setRow(). Rows which would fall outside the buffer are skipped.
+    /// \param rows the rows to copy
+    /// \param first the row of the back buffer to copy the first row to
+    /// \param count how many rows to copy
+
+    void blitRows(const uint16_t *rows, int first, int count);
+
+    /// Fill a rectangle of the back buffer with a colour. The rectangle
+    /// is clipped to the buffer.
+    /// \param x the x coordinate of the left edge
+    /// \param y the y coordinate of the top edge
+    /// \param w the width
+    /// \param h the height
+    /// \param col the colour to use: BLACK, GREEN, RED or YELLOW.
+
+    void fillRect(int x, int y, int w, int h, unsigned char col);
+
+    /// Draw a horizontal line of w pixels, starting at x,y and going right.
+
+    void hline(int x, int y, int w, unsigned char col);
+
+    /// Draw a vertical line of h pixels, starting at x,y and going down.
+
+    void vline(int x, int y, int h, unsigned char col);
+
+    /// Set the brightness of the red and green LEDs of a pixel, from 0 (off)
+    /// to 15 (as bright as set() makes them), when begin() was given AF_BCM.
+    /// Like set(), this writes to the back buffer and is shown at the next
+    /// swap, and there are separate front and back brightness buffers which
+    /// swap along with the others. Anything drawn with set() and the other
+    /// calls is shown at full brightness on top, so a pixel set to RED with
+    /// a green level of 4 is orange. Does nothing if x or y is out of range,
+    /// or on a TFT display.
+    ///
+    /// The levels are shown by bit-angle modulation: each row is lit for 1,
+    /// 2, 4 and 8 fifteenths of its tick with the matching bit of each level,
+    /// which takes three more short interrupts a tick (on timer 1's compare
+    /// B) rather than one for each brightness step.
+    /// \param x the x coordinate of the pixel to write (0-7)
+    /// \param y the y coordinate of the pixel to write (0-7)
+    /// \param red the brightness of the red LED (0-15)
+    /// \param green the brightness of the green LED (0-15)
+
+    void setLevel(int x, int y, uint8_t red, uint8_t green);
     
-    /// Set all pixels in the back buffer to black
+    /// Set all pixels in the back buffer to black (and, with AF_BCM, all
+    /// the levels to 0)
     
     void clear();
     
@@ -136,6 +353,26 @@ public:
     
     int getButtonDown(unsigned char c);
 
+    /// Get the next button press or release from the queue which the
+    /// interrupt fills. Unlike getButtonDown(), every press is reported,
+    /// even if there were several in one frame, and each one is stamped
+    /// with the tick it happened on. Presses are queued as soon as they
+    /// have been debounced, with no need to call swap().
+    /// \param e the event to fill in
+    /// \return true if there was an event, false if the queue was empty
+
+    bool pollEvent(AberLEDEvent *e);
+
+    /// Return the number of events which have been thrown away because
+    /// the queue was full - call pollEvent() more often if this goes up.
+
+    uint16_t getLostEvents();
+
+    /// Return the number of interrupt ticks since begin(). This wraps
+    /// around to zero after 65535.
+
+    uint16_t getTickCount();
+
     /// Call this to write to the back buffer directly.
     /// It returns a pointer to the buffer: a set of 8 16-bit ints,
     /// each pair of bits representing a pixel.
@@ -145,6 +382,99 @@ public:
     /// Return the number of interrupt ticks which occurred in the
     /// last swap()-swap() cycle
     int getTicks();
+
+    /// Return the game time at the last swap(), in milliseconds. This goes up
+    /// by the length of the interrupt ticks in each frame, so it keeps close to
+    /// millis(), but it changes only once a frame and can be replayed exactly.
+    /// Use this for game timers instead of millis() if you want to use
+    /// startReplay(). It is just millis() if there is no interrupt.
+
+    unsigned long getFrameTime();
+
+    /// Add a task to the scheduler, to be run every period milliseconds by
+    /// runTasks() once it has been started with startTask(). The tasks are
+    /// kept to a fixed timestep: each run is due exactly a period after the
+    /// one before, however late that one was, so a rate doesn't drift by a
+    /// frame every period as `if (now - last > PERIOD) last = now;` does.
+    /// Call this in setup().
+    /// \param fn the function to run
+    /// \param period the time between runs, in milliseconds (at least 1)
+    /// \return the task's number, or -1 if all ABERLED_TASKS are taken
+
+    int addTask(void (*fn)(), uint16_t period);
+
+    /// Start a task, so that it first runs a period after now and then every
+    /// period after that. Starting a task which has already started starts it
+    /// again from now, which can be done from the task itself.
+    /// \param task the number addTask() returned
+    /// \param now the time, on the same clock as runTasks() is given
+    /// \param period a new period, or 0 to keep the one it has
+
+    void startTask(int task, unsigned long now, uint16_t period = 0);
+
+    /// Change a task's period, keeping to its timestep: the next run is due
+    /// the new period after the last one. Called from the task itself, this
+    /// sets the time to the run after this one.
+
+    void setTaskPeriod(int task, uint16_t period);
+
+    /// Stop a task, until it is started again.
+
+    void stopTask(int task);
+
+    /// Stop all the tasks.
+
+    void stopTasks();
+
+    /// Run every task which is due by now, in the order they fell due (and
+    /// so in the order they were added, for tasks due together), catching up
+    /// with any runs which have been missed - a task with a 100ms period
+    /// runs twice in a frame which took 200ms. A task which has fallen more
+    /// than four periods behind drops the runs before that. Tasks may start
+    /// and stop tasks, including themselves. Give this the same time every
+    /// frame on both ends of a replay or a link and the tasks run the same:
+    /// getFrameTime(), which counts the interrupt's ticks, or a step count.
+    /// \param now the time to run the tasks up to, in milliseconds
+
+    void runTasks(unsigned long now);
+
+    /// Call this just before swap() to sleep until there is something to do:
+    /// until the next started task will be due by the frame time at the
+    /// swap, or until a button changes. This only makes sense if runTasks()
+    /// is given getFrameTime(). It returns straight away if no task has
+    /// been started, if the interrupt isn't running or during a replay.
+    /// Anything else the loop watches, such as Serial, is not waited for.
+
+    void idleUntilTask();
+
+    /// Set how often the interrupt draws to the display. The interrupt itself
+    /// keeps running at the same speed (500Hz for the LED, 200Hz for the TFT),
+    /// so the buttons are still read and the game time still kept at that rate,
+    /// but only every nth tick sends a row to the display. Lower rates leave more
+    /// of the processor for loop() - on the LED, a row is drawn each time, so
+    /// the whole matrix is redrawn at an eighth of this and will flicker if it
+    /// is set much below the default. Call this after begin().
+    /// \param hz the refresh rate wanted, in ticks with drawing per second
+    /// \return the rate actually chosen: the tick rate divided by 1 to 16
+
+    int setRefreshRate(int hz);
+
+    /// Return the refresh rate, which may be lower than the one given to
+    /// setRefreshRate() if setAdaptiveRefresh() has turned it down.
+
+    int getRefreshRate();
+
+    /// Turn on adaptive refresh: every 64 ticks the library works out how much
+    /// of the processor the interrupt has been using, and if it is more than
+    /// maxLoad percent it lowers the refresh rate a step (to as little as a
+    /// sixteenth of the tick rate), raising it back towards the rate given to
+    /// setRefreshRate() when there is plenty to spare. The buttons are read at
+    /// the same rate whatever happens. The check is done in swap(), so it only
+    /// adapts while the game is swapping frames.
+    /// \param maxLoad the largest share of the processor, in percent, the
+    /// interrupt should take - 0 turns adaptive refresh off (the default)
+
+    void setAdaptiveRefresh(byte maxLoad);
     
     /// clear the string which is written to the text area on a TFT display.
     void clearText();
@@ -155,8 +485,57 @@ public:
     /// If the resulting string would be too long, nothing is done.
     void addToText(const char *s);
 
+    /// Write a string from flash to the text area, as in `addToText(F("Score "))`,
+    /// which saves the RAM the string would otherwise take up.
+    void addToText(const __FlashStringHelper *s);
+
     /// Write a number to the text area - see the string version for details.
     void addToText(int n);
+
+    /// Set up a HUD field on a TFT display: a fixed-width number, right aligned,
+    /// in white on black. Unlike the text area, only the digits which change
+    /// are redrawn, so a score can be updated every frame for next to nothing.
+    /// The grid takes the top 128 lines and the text starts at line 150, so
+    /// lines 130 to 141 are free for fields. Does nothing on an LED display.
+    /// \param slot the field, from 0 to ABERLED_HUDSLOTS-1
+    /// \param x the left edge of the field in pixels
+    /// \param y the top edge - the characters are 8 pixels high
+    /// \param digits the width of the field in characters, up to 6 (a minus sign
+    /// takes one). 0 stops the field being drawn, leaving it on the screen.
+    void setHudField(byte slot, byte x, byte y, byte digits);
+
+    /// Set the number in a HUD field. It is drawn in swap(), and only if it has
+    /// changed. A number too big for the field shows as 9s.
+    void setHudNumber(byte slot, int value);
+
+    /// Return true if begin() chose the TFT display rather than the LED matrix.
+
+    bool usingTFT();
+
+    /// Draw the cells on the TFT as tiles from a sheet in PROGMEM, rather than as
+    /// flat squares: four 12x12 tiles, one for each colour from BLACK to YELLOW,
+    /// of TFT_TILEBYTES (36) bytes each. Each pixel takes 2 bits, four to a byte
+    /// with the first pixel in the lowest bits, going along each row in turn;
+    /// 0 is black, 1 the cell's colour, 2 a lighter shade of it and 3 a darker
+    /// one. The whole grid is redrawn in the new tiles on the next refresh.
+    /// Does nothing on an LED display.
+    /// \param sheet the tiles, or NULL to go back to flat squares
+    void setTiles(const uint8_t *sheet);
+
+    /// Draw some of the cells in a row of a grid on the TFT, as flat squares in
+    /// the colours given to begin() - or as tiles, if tiles are on and size is
+    /// 12. This is how AberLEDGrid draws itself; the rows are in the same 2-bit
+    /// format as getBuffer(), up to 16 cells wide. Does nothing on an LED
+    /// display.
+    /// \param x the left edge of the first cell's square
+    /// \param y the top edge of the row's squares
+    /// \param pitch the distance from one cell to the next, in pixels
+    /// \param size the width and height of each square
+    /// \param bits the row
+    /// \param changed which cells to draw - one or both of each cell's bits set
+
+    void drawCells(int16_t x, int16_t y, uint8_t pitch, uint8_t size,
+                   uint32_t bits, uint32_t changed);
     
     /// Use only when interrupts are disabled - copies the front
     /// buffer to the display
@@ -169,13 +548,107 @@ public:
     /// \param rev revision number - REV00 or REV01.
     static void setRevision(int rev);
 
-    /// return the version string
-    static const char *version();
+    /// return the version string. It is kept in flash, so print it
+    /// (Serial.print() and the like understand this) or copy it with strcpy_P().
+    static const __FlashStringHelper *version();
+
+    /// Find out how much RAM is free, how little there has been since begin(),
+    /// and how much the library's buffers are taking.
+    /// \param m the report to fill in
+
+    void memoryReport(AberLEDMemory *m);
+
+#if ABERLED_TRACE
+    /// Add a record to the trace log. This is very quick - the record
+    /// is just stored in RAM, and sent to Serial by flushTrace(), which
+    /// swap() calls. Serial must have been started with Serial.begin().
+    /// Each record also holds the number of milliseconds since the previous
+    /// one. Nothing goes to Serial until the sketch first calls this or
+    /// startRecording() - the library's own records, such as TRACE_TEXT,
+    /// are only kept from then on. Only available if ABERLED_TRACE is set
+    /// in AberLED_Setup.h, otherwise this does nothing.
+    /// \param id what happened - use a number under 0xf0
+    /// \param arg some more information, such as a state number
+
+    void trace(uint8_t id, uint8_t arg = 0);
+
+    /// Send as many stored trace records to Serial as will fit into its
+    /// output buffer without waiting.
+
+    void flushTrace();
+
+    /// Start recording the game into the trace log: the seed, then the
+    /// buttons pressed and the ticks taken in every frame (see TRACE_FRAME).
+    /// Together with getFrameTime() that's everything needed to play the
+    /// game again exactly, as long as the sketch calls randomSeed(seed) and
+    /// takes its time from getFrameTime(). Make sure records aren't lost -
+    /// a fast baud rate like 115200 helps.
+    /// \param seed the random seed the sketch is using
+
+    void startRecording(uint16_t seed);
+
+    /// Play back a recording made with startRecording(), reading it from a
+    /// stream (such as Serial). This waits for the seed and returns it, for the
+    /// sketch to pass to randomSeed(). From then on the buttons come from the
+    /// recording instead of the board, getButton() returns the same as getButtonDown(),
+    /// and swap() doesn't wait for the interrupt, so the game runs as fast as it can.
+    /// Other trace records in the stream are ignored. Playback stops if nothing
+    /// arrives for a second.
+    /// \param in the stream to read from
+    /// \return the seed
+
+    uint16_t startReplay(Stream &in);
+
+    /// Return true if we're playing back a recording.
+
+    bool isReplaying();
+#else
+    void trace(uint8_t id, uint8_t arg = 0) {}
+    void flushTrace() {}
+    bool isReplaying() { return false; }
+#endif
+
+#if ABERLED_STATS
+    /// Copy the timing statistics collected since begin() or the last
+    /// resetFrameStats() into an array, with one entry for each AberLEDTimer.
+    /// Only available if ABERLED_STATS is set in AberLED_Setup.h.
+    /// \param stats the array to fill in, of AT_COUNT entries
+
+    void getFrameStats(AberLEDTiming *stats);
+
+    /// Clear all the timing statistics.
+
+    void resetFrameStats();
+
+    /// Record a time in the statistics. This is usually done with ABERLED_TIMED().
+    /// \param timer which timer the time is for, usually AT_INPUT, AT_UPDATE or AT_RENDER
+    /// \param us the time in microseconds
+
+    void addTiming(AberLEDTimer timer, unsigned long us);
+#endif
+
+private:
+    /// the buffer currently being drawn to (here so setFast() can be inline)
+    static uint16_t *backBuffer;
 };
 
 /// this is the single instance of the LED class - for documentation see AberLEDClass.
 
 extern AberLEDClass AberLED;
 
+/// Run some code and record how long it took, e.g.
+/// `ABERLED_TIMED(AT_UPDATE, updateModel());`. This just runs the code
+/// if ABERLED_STATS is turned off.
+
+#if ABERLED_STATS
+#define ABERLED_TIMED(timer, code) do { \
+        unsigned long _start = micros(); \
+        code; \
+        AberLED.addTiming(timer, micros() - _start); \
+    } while (0)
+#else
+#define ABERLED_TIMED(timer, code) do { code; } while (0)
+#endif
+
 
 #endif /* __ABERLED_H */
@@ -0,0 +1,163 @@
+/**
+ * @file AberLEDGrid.h
+ * @brief A double-buffered grid of any size up to 16x16, for the TFT.
+ *
+ * AberLED itself always has an 8x8 display, because that's what the LED
+ * matrix is. On a TFT a game can use a grid of a different size instead -
+ * a 10x20 Tetris well, say - by declaring an AberLEDGrid:
+ *
+ *     AberLEDGrid<10, 20> grid;
+ *
+ * and drawing into that rather than into AberLED's buffer, then calling
+ * grid.swap() instead of AberLED.swap(). The size is fixed when the sketch is
+ * compiled, so each row is packed into the smallest integer which will hold
+ * it (2 bits a cell, as in AberLED's own buffers) and there is no padding.
+ * The cells are made as big as they can be in the 128x148 pixels above the
+ * text area, and centred across the screen.
+ *
+ * Leave AberLED's own buffer black while using a grid, or the two will be
+ * drawn over each other. Don't use AberLED.scrollDown() with a grid: it moves
+ * lines 0-127 of the TFT with the hardware scrolling, so the grid's pixels
+ * scroll too, but the grid doesn't know they've moved and will draw its
+ * changed cells in the wrong places.
+ * On an LED display, the top left 8x8 cells of the grid are shown.
+ */
+
+#ifndef __ABERLEDGRID_H
+#define __ABERLEDGRID_H
+
+#include "AberLED.h"
+
+/// Picks the smallest unsigned type which will hold a row of cells.
+/// Used by AberLEDGrid - you shouldn't need this yourself.
+template <uint8_t W, bool BYTE = (W <= 4), bool WORD = (W <= 8)>
+struct AberLEDGridRow {
+    typedef uint32_t type;
+};
+template <uint8_t W, bool WORD>
+struct AberLEDGridRow<W, true, WORD> {
+    typedef uint8_t type;
+};
+template <uint8_t W>
+struct AberLEDGridRow<W, false, true> {
+    typedef uint16_t type;
+};
+
+/// A grid of W by H cells, with a front and a back buffer like AberLED's.
+/// The cells take the same colours as AberLED.set(): BLACK, GREEN, RED and
+/// YELLOW.
+
+template <uint8_t W, uint8_t H>
+class AberLEDGrid {
+    static_assert(W >= 1 && W <= 16, "AberLEDGrid can be 1 to 16 cells wide");
+    static_assert(H >= 1 && H <= 37, "AberLEDGrid can be 1 to 37 cells high");
+
+public:
+    /// the type of a row: two bits for each cell, with cell 0 in the lowest bits
+    typedef typename AberLEDGridRow<W>::type Row;
+
+    /// the width of the grid, in cells
+    static const uint8_t WIDTH = W;
+    /// the height of the grid, in cells
+    static const uint8_t HEIGHT = H;
+
+    /// the distance from one cell to the next on the TFT, in pixels - as big
+    /// as will fit in 128 pixels across and 148 down
+    static const uint8_t PITCH = 128 / W < 148 / H ? 128 / W : 148 / H;
+    /// the size of the square drawn for each cell, leaving a gap between (the
+    /// 8x8 AberLED display has 12 pixel squares 16 pixels apart)
+    static const uint8_t CELLSIZE = PITCH - PITCH / 4;
+    /// where the top left cell's square is drawn (not LEFT and TOP, which
+    /// would hide the button codes of those names)
+    static const int16_t ORIGINX = (128 - W * PITCH) / 2 + PITCH / 8;
+    static const int16_t ORIGINY = PITCH / 8;
+
+    AberLEDGrid() : back(bufferA), front(bufferB) {
+        memset(bufferA, 0, sizeof(bufferA));
+        memset(bufferB, 0, sizeof(bufferB));
+    }
+
+    /// Set a cell of the back buffer. Does nothing if x or y is out of range.
+    /// \param x the column (0 to W-1)
+    /// \param y the row (0 to H-1)
+    /// \param col the colour to use: BLACK, GREEN, RED or YELLOW.
+
+    void set(int x, int y, uint8_t col) {
+        if (x >= 0 && x < W && y >= 0 && y < H)
+            setFast(x, y, col);
+    }
+
+    /// Like set(), but without checking that x and y are in range.
+
+    inline void setFast(int x, int y, uint8_t col) {
+        Row *p = back + y;
+        x *= 2;
+        *p = (*p & ~((Row)3 << x)) | ((Row)col << x);
+    }
+
+    /// Return the colour of a cell in the back buffer, or BLACK if x or y
+    /// is out of range.
+
+    uint8_t get(int x, int y) const {
+        if (x < 0 || x >= W || y < 0 || y >= H)
+            return BLACK;
+        return (back[y] >> (x * 2)) & 3;
+    }
+
+    /// Set a whole row of the back buffer. Does nothing if y is out of range.
+
+    void setRow(int y, Row bits) {
+        if (y >= 0 && y < H)
+            back[y] = bits;
+    }
+
+    /// Return a whole row of the back buffer, or 0 if y is out of range.
+
+    Row getRow(int y) const {
+        return y >= 0 && y < H ? back[y] : 0;
+    }
+
+    /// Return the back buffer, an array of H rows, to write to directly.
+
+    Row *getBuffer() {
+        return back;
+    }
+
+    /// Set every cell of the back buffer to BLACK.
+
+    void clear() {
+        memset(back, 0, sizeof(bufferA));
+    }
+
+    /// Show the back buffer, and make the old front buffer the new back
+    /// buffer - so, as with AberLED, it doesn't hold what was just drawn.
+    /// Only the cells which differ from the front buffer are sent to the
+    /// TFT. This then calls AberLED.swap(), so call this instead of that.
+
+    void swap() {
+        if (AberLED.usingTFT()) {
+            for (uint8_t y = 0; y < H; y++) {
+                Row changed = back[y] ^ front[y];
+                if (changed)
+                    AberLED.drawCells(ORIGINX, ORIGINY + y * PITCH, PITCH,
+                                      CELLSIZE, back[y], changed);
+            }
+        } else {
+            // the LED matrix just shows as much as will fit
+            uint16_t *led = AberLED.getBuffer();
+            uint16_t mask = W >= 8 ? 0xffff : (1u << (W * 2)) - 1;
+            for (uint8_t y = 0; y < 8; y++)
+                led[y] = y < H ? back[y] & mask : 0;
+        }
+        Row *t = front;
+        front = back;
+        back = t;
+        AberLED.swap();
+    }
+
+private:
+    Row bufferA[H], bufferB[H];
+    Row *back, *front;
+};
+
+#endif /* __ABERLEDGRID_H */
@@ -0,0 +1,130 @@
+/**
+ * @file AberLEDLink.h
+ * @brief Small checked packets between two boards over a serial port.
+ *
+ * Connect TX of each board to RX of the other (and the grounds together),
+ * and an AberLEDLink on each can send the other packets of up to
+ * LINK_MAXPAYLOAD bytes. A packet is a sync byte, a header holding the type
+ * and length, a frame number, the payload, and the exclusive-or of everything
+ * after the sync byte (the same check as the trace log uses):
+ *
+ *     0x5a, type << 4 | length, frame, payload..., check
+ *
+ * so there are 4 bytes on top of the payload. Anything which doesn't check
+ * out is skipped until the next good packet, which means the trace log can
+ * share the port - the other end just ignores it. What the types and frame
+ * numbers mean is up to the sketch; see 6.ino's versus mode.
+ *
+ * The hardware serial port has its own interrupt-driven buffers, so send()
+ * only ever copies into the transmit buffer (and refuses the packet if it
+ * won't fit), and receive() only takes what has already come in. Neither
+ * waits for the wire. Call Serial.begin() first - 115200 baud moves about 11
+ * bytes a millisecond.
+ */
+
+#ifndef __ABERLEDLINK_H
+#define __ABERLEDLINK_H
+
+#include "AberLED.h"
+
+#define LINK_SYNC 0x5a
+/// the most payload a packet can carry
+#define LINK_MAXPAYLOAD 8
+
+/// A packet, as passed to AberLEDLink::send() or filled in by receive().
+struct AberLEDPacket {
+    /// set by the sketch, from 0 to 15
+    uint8_t type;
+    uint8_t frame;
+    /// the number of bytes in data, up to LINK_MAXPAYLOAD
+    uint8_t len;
+    uint8_t data[LINK_MAXPAYLOAD];
+};
+
+class AberLEDLink {
+public:
+    AberLEDLink(HardwareSerial &port) : port(port), got(0), bad(0) {}
+
+    /// Put a packet into the transmit buffer. Returns false, sending nothing,
+    /// if there isn't room for all of it.
+
+    bool send(const AberLEDPacket &p) {
+        if (p.len > LINK_MAXPAYLOAD || port.availableForWrite() < p.len + 4)
+            return false;
+        uint8_t head = p.type << 4 | p.len;
+        uint8_t check = head ^ p.frame;
+        port.write(LINK_SYNC);
+        port.write(head);
+        port.write(p.frame);
+        for (uint8_t i = 0; i < p.len; i++) {
+            port.write(p.data[i]);
+            check ^= p.data[i];
+        }
+        port.write(check);
+        return true;
+    }
+
+    /// Read what has arrived, and return true with the next good packet in p,
+    /// or false if there isn't a whole one yet.
+
+    bool receive(AberLEDPacket *p) {
+        for (;;) {
+            // throw away anything before a sync byte
+            uint8_t skip = 0;
+            while (skip < got && buf[skip] != LINK_SYNC)
+                skip++;
+            drop(skip);
+
+            if (got >= 2) {
+                uint8_t len = buf[1] & 15;
+                if (len > LINK_MAXPAYLOAD) {
+                    // not really a packet - look for the next sync
+                    drop(1);
+                    bad++;
+                    continue;
+                }
+                if (got >= len + 4) {
+                    uint8_t check = 0;
+                    for (uint8_t i = 1; i < len + 3; i++)
+                        check ^= buf[i];
+                    if (check != buf[len + 3]) {
+                        drop(1);
+                        bad++;
+                        continue;
+                    }
+                    p->type = buf[1] >> 4;
+                    p->frame = buf[2];
+                    p->len = len;
+                    memcpy(p->data, buf + 3, len);
+                    drop(len + 4);
+                    return true;
+                }
+            }
+            if (port.available() <= 0)
+                return false;
+            buf[got++] = port.read();
+        }
+    }
+
+    /// the number of times something which looked like a packet didn't check
+    /// out (which includes anything else sent on the same port, such as the
+    /// trace log)
+
+    uint16_t badPackets() const {
+        return bad;
+    }
+
+private:
+    void drop(uint8_t n) {
+        got -= n;
+        memmove(buf, buf + n, got);
+    }
+
+    HardwareSerial &port;
+    // the start of a packet, as far as it has arrived
+    uint8_t buf[LINK_MAXPAYLOAD + 4];
+    uint8_t got;
+    uint16_t bad;
+};
+
+#endif /* __ABERLEDLINK_H */
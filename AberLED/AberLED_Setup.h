@@ -0,0 +1,103 @@
+//                            ABERLED SETTINGS
+//        Compile-time options for the AberLED library (not the TFT driver,
+//        which has its own settings in User_Setup.h)
+
+#ifndef __ABERLED_SETUP_H
+#define __ABERLED_SETUP_H
+
+// ##################################################################################
+//
+// Host build
+//
+// ##################################################################################
+
+// This is set to 1 by the Makefile in extras/host, which builds the library and
+// a sketch to run on a desktop machine with a simulated display and buttons.
+// Leave it at 0 for the board.
+
+#ifndef ABERLED_HOST
+#define ABERLED_HOST 0
+#endif
+
+// ##################################################################################
+//
+// Display
+//
+// ##################################################################################
+
+// Choose which display the library drives. With ABERLED_BOTH (the default) the
+// code for both is compiled in, and begin() picks one from its flags. Choosing
+// just one leaves the other out altogether, which saves flash (the TFT driver
+// and its font are large) and makes the interrupt a little quicker; begin()'s
+// AF_LEDDISPLAY and AF_TFTDISPLAY flags are then ignored.
+
+#define ABERLED_BOTH 0
+#define ABERLED_TFT 1
+#define ABERLED_LED 2
+
+#ifndef ABERLED_DISPLAY
+#if ABERLED_HOST
+#define ABERLED_DISPLAY ABERLED_LED // the host build simulates the LED matrix
+#else
+#define ABERLED_DISPLAY ABERLED_BOTH
+#endif
+#endif
+
+// The number of HUD fields which AberLED.setHudField() can set up on a TFT
+// display. Each takes 11 bytes of RAM.
+
+#ifndef ABERLED_HUDSLOTS
+#define ABERLED_HUDSLOTS 4
+#endif
+
+// Set this to 1 to allow begin()'s AF_BCM flag, which shows the LED matrix at 16
+// brightnesses per colour (see AberLED.setLevel()). It takes 128 bytes of RAM for
+// the brightness buffers, so it is off unless you want it, and isn't compiled at
+// all if ABERLED_DISPLAY is ABERLED_TFT.
+
+#ifndef ABERLED_BCM
+#define ABERLED_BCM 0
+#endif
+
+// The number of tasks AberLED.addTask() can hold. Each takes 9 bytes of RAM.
+
+#ifndef ABERLED_TASKS
+#define ABERLED_TASKS 6
+#endif
+
+// ##################################################################################
+//
+// Timing statistics
+//
+// ##################################################################################
+
+// Set this to 1 to collect timing statistics for the interrupt, the drawing
+// code and swap(), which can be read with AberLED.getFrameStats(). The statistics
+// take about 200 bytes of RAM and a few microseconds every tick, so they are
+// off (and not compiled at all) unless you are measuring something.
+
+#ifndef ABERLED_STATS
+#define ABERLED_STATS 0
+#endif
+
+// ##################################################################################
+//
+// Trace log
+//
+// ##################################################################################
+
+// Set this to 1 to allow AberLED.trace(), which stores small binary records in
+// a RAM buffer and sends them to Serial a few at a time from swap(), so they
+// never hold up the game. AberLED/extras/tracedecode.py turns them back into
+// text. Set it to 0 to remove the buffer and make trace() do nothing.
+
+#ifndef ABERLED_TRACE
+#define ABERLED_TRACE 1
+#endif
+
+// The number of records the trace buffer holds. Each one takes 4 bytes of RAM.
+// Must be a power of 2.
+
+#define ABERLED_TRACESIZE 16
+
+#endif /* __ABERLED_SETUP_H */
@@ -63,6 +63,12 @@ TFT_ST7735::TFT_ST7735(int16_t w, int16_t h)
   textbgcolor = 0x0000;
   padX = 0;
   textwrap  = true;
+  burstDepth = 0;
+  queueHead = queueTail = 0;
+  scrollTop = 0;
+  tileSheet = NULL;
+  tilePalettes = NULL;
+  cellColours = NULL;
   textdatum = 0; // Left text alignment is default
   fontsloaded = 0;
 
@@ -101,12 +107,15 @@ TFT_ST7735::TFT_ST7735(int16_t w, int16_t h)
 ***************************************************************************************/
 void TFT_ST7735::spiwrite(uint8_t c)
 {
-  savedSPCR = SPCR;
-  SPCR = mySPCR;
+  // inside a burst SPCR has already been set up
+  if (!burstDepth) {
+    savedSPCR = SPCR;
+    SPCR = mySPCR;
+  }
   SPDR = c;
   asm volatile( "nop\n\t" ::); // Sync SPIF
   while (!(SPSR & _BV(SPIF)));
-  SPCR = savedSPCR;
+  if (!burstDepth) SPCR = savedSPCR;
 }
 
 /***************************************************************************************
@@ -118,7 +127,7 @@ void TFT_ST7735::writecommand(uint8_t c)
   TFT_DC_C;
   TFT_CS_L;
   spiwrite(c);
-  TFT_CS_H;
+  if (!burstDepth) TFT_CS_H;
 }
 
 /***************************************************************************************
@@ -130,7 +139,7 @@ void TFT_ST7735::writedata(uint8_t c)
   TFT_DC_D;
   TFT_CS_L;
   spiwrite(c);
-  TFT_CS_H;
+  if (!burstDepth) TFT_CS_H;
 }
 
 /***************************************************************************************
@@ -192,6 +201,38 @@ static inline void spi_end(void) {
 #define spi_end()
 #endif
 
+/***************************************************************************************
+** Function name:           beginBurst
+** Description:             Start a burst of SPI transfers to the TFT
+***************************************************************************************/
+// SPCR is set up and CS is asserted once, so that the commands and data which
+// follow only need to toggle DC. Bursts can be nested, only the outermost
+// beginBurst()/endBurst() pair does anything. The last byte sent must have
+// finished before endBurst() is called - all the drawing functions do this.
+
+void TFT_ST7735::beginBurst(void)
+{
+  if (!burstDepth++) {
+    spi_begin();
+    savedSPCR = SPCR;
+    SPCR = mySPCR;
+    TFT_CS_L;
+  }
+}
+
+/***************************************************************************************
+** Function name:           endBurst
+** Description:             Finish a burst of SPI transfers, raising CS
+***************************************************************************************/
+void TFT_ST7735::endBurst(void)
+{
+  if (!--burstDepth) {
+    TFT_CS_H;
+    SPCR = savedSPCR;
+    spi_end();
+  }
+}
+
 /***************************************************************************************
 ** Function name:           begin
 ** Description:             Included for backwards compatibility
@@ -977,7 +1018,7 @@ void TFT_ST7735::drawChar(int16_t x, int16_t y, unsigned char c, uint16_t color,
     return;
   boolean fillbg = (bg != color);
 
-spi_begin();
+beginBurst();
 
 // This is about 5 times faster for textsize=1 with background (at 200us per character)
   if ((size==1) && fillbg)
@@ -1039,7 +1080,7 @@ spi_begin();
     }
   }
 
-spi_end();
+endBurst();
 
 #endif // LOAD_GLCD
 }
@@ -1052,11 +1093,10 @@ spi_end();
 
 void TFT_ST7735::setAddrWindow(int16_t x0, int16_t y0, int16_t x1, int16_t y1)
 {
-  spi_begin();
+  beginBurst();
   setWindow(x0, y0, x1, y1);
-  TFT_CS_H;
   while (!(SPSR & _BV(SPIF)));
-  spi_end();
+  endBurst();
 }
 
 /***************************************************************************************
@@ -1112,7 +1152,7 @@ void TFT_ST7735::drawPixel(uint16_t x, uint16_t y, uint16_t color)
 {
   // Faster range checking, possible because x and y are unsigned
   if ((x >= _width) || (y >= _height)) return;
-  spi_begin();
+  beginBurst();
 
   TFT_DC_C;
   TFT_CS_L;
@@ -1150,9 +1190,7 @@ if (addr_row != y) {
   SPDR = color >> 8; spiWait17();
   SPDR = color; spiWait14();
 
-  TFT_CS_H;
-
-  spi_end();
+  endBurst();
 }
 
 /***************************************************************************************
@@ -1161,9 +1199,7 @@ if (addr_row != y) {
 ***************************************************************************************/
 void TFT_ST7735::pushColor(uint16_t color)
 {
-  spi_begin();
-
-  TFT_CS_L;
+  beginBurst();
 
   //uint8_t backupSPCR =SPCR;
   //SPCR = mySPCR;
@@ -1175,9 +1211,7 @@ void TFT_ST7735::pushColor(uint16_t color)
 
   //SPCR = backupSPCR;
 
-  TFT_CS_H;
-
-  spi_end();
+  endBurst();
 }
 
 /***************************************************************************************
@@ -1186,14 +1220,13 @@ void TFT_ST7735::pushColor(uint16_t color)
 ***************************************************************************************/
 void TFT_ST7735::pushColor(uint16_t color, uint16_t len)
 {
-  spi_begin();
+  beginBurst();
 
   TFT_CS_L;
   spiWrite16(color, len);
-  TFT_CS_H;
   while (!(SPSR & _BV(SPIF)));
 
-  spi_end();
+  endBurst();
 }
 
 /***************************************************************************************
@@ -1208,7 +1241,7 @@ void TFT_ST7735::pushColor(uint16_t color, uint16_t len)
 void TFT_ST7735::pushColors(uint16_t *data, uint8_t len)
 {
   uint16_t color;
-  spi_begin();
+  beginBurst();
 
   TFT_CS_L;
 
@@ -1228,9 +1261,7 @@ void TFT_ST7735::pushColors(uint16_t *data, uint8_t len)
   }
   while (!(SPSR & _BV(SPIF)));
 
-  TFT_CS_H;
-
-  spi_end();
+  endBurst();
 }
 
 /***************************************************************************************
@@ -1241,7 +1272,7 @@ void TFT_ST7735::pushColors(uint16_t *data, uint8_t len)
 
 void TFT_ST7735::pushColors(uint8_t *data, uint16_t len)
 {
-  spi_begin();
+  beginBurst();
   len = len<<1;
 
   TFT_CS_L;
@@ -1257,10 +1288,9 @@ void TFT_ST7735::pushColors(uint8_t *data, uint16_t len)
       "2:	       \n"	//
     );
   }
-  TFT_CS_H;
-
   while (!(SPSR & _BV(SPIF)));
-  spi_end();
+
+  endBurst();
 }
 
 /***************************************************************************************
@@ -1426,14 +1456,13 @@ void TFT_ST7735::drawFastVLine(int16_t x, int16_t y, int16_t h, uint16_t color)
   if ((y + h - 1) >= _height) h = _height - y;
 #endif
 
-  spi_begin();
+  beginBurst();
 
   setWindow(x, y, x, _height);
 
   spiWrite16(color, h);
-  TFT_CS_H;
 
-  spi_end();
+  endBurst();
 }
 
 /***************************************************************************************
@@ -1448,13 +1477,12 @@ void TFT_ST7735::drawFastHLine(int16_t x, int16_t y, int16_t w, uint16_t color)
   if ((x + w - 1) >= _width)  w = _width - x;
 #endif
 
-  spi_begin();
+  beginBurst();
   setWindow(x, y, _width, y);
 
   spiWrite16(color, w);
-  TFT_CS_H;
 
-  spi_end();
+  endBurst();
 }
 
 /***************************************************************************************
@@ -1470,15 +1498,193 @@ void TFT_ST7735::fillRect(int16_t x, int16_t y, int16_t w, int16_t h, uint16_t c
   if ((y + h - 1) > _height) h = _height - y;
 #endif
 
-  spi_begin();
+  beginBurst();
   setWindow(x, y, x + w - 1, y + h - 1);
 
   if (h > w) tftswap(h, w);
 
   while (h--) spiWrite16(color, w);
-  TFT_CS_H;
 
-  spi_end();
+  endBurst();
+}
+
+/***************************************************************************************
+** Function name:           setTiles
+** Description:             set the tile sheet (PROGMEM) and palettes (RAM) for drawTile()
+***************************************************************************************/
+void TFT_ST7735::setTiles(const uint8_t *sheet, const uint16_t *palettes)
+{
+  tileSheet = sheet;
+  tilePalettes = palettes;
+}
+
+/***************************************************************************************
+** Function name:           setCellColours
+** Description:             set the colours (RAM) queueCells() fills its cells with
+***************************************************************************************/
+void TFT_ST7735::setCellColours(const uint16_t *colours)
+{
+  cellColours = colours;
+}
+
+/***************************************************************************************
+** Function name:           drawTile
+** Description:             draw a tile from the sheet with its top left corner at x,y
+***************************************************************************************/
+void TFT_ST7735::drawTile(int16_t x, int16_t y, uint8_t tile)
+{
+  if (!tileSheet) return;
+  const uint8_t *p = tileSheet + tile * TFT_TILEBYTES;
+  const uint16_t *pal = tilePalettes + tile * 4;
+
+  beginBurst();
+  setWindow(x, y, x + TFT_TILESIZE - 1, y + TFT_TILESIZE - 1);
+
+  // The window keeps the pixels in order, so we can send a run of the same
+  // colour with one spiWrite16() even when it carries on into the next row.
+  // Most tiles are largely one colour, so there are only a few runs.
+  uint8_t c = pgm_read_byte(p) & 3, run = 0;
+  for (uint8_t i = 0; i < TFT_TILEBYTES; i++) {
+    uint8_t bits = pgm_read_byte(p++);
+    for (uint8_t j = 0; j < 4; j++, bits >>= 2) {
+      if ((bits & 3) != c) {
+        spiWrite16(pal[c], run);
+        c = bits & 3;
+        run = 0;
+      }
+      run++;
+    }
+  }
+  spiWrite16(pal[c], run);
+
+  endBurst();
+}
+
+/***************************************************************************************
+** Function name:           enqueue
+** Description:             add a drawing operation to the queue
+***************************************************************************************/
+boolean TFT_ST7735::enqueue(const tftqueueop &op)
+{
+  uint8_t next = (queueHead + 1) & (TFT_QUEUE_SIZE - 1);
+  if (next == queueTail) return false; // full
+
+  queue[queueHead] = op;
+  // make sure the operation is stored before runQueue() can see it
+  asm volatile( "" ::: "memory");
+  queueHead = next;
+  return true;
+}
+
+/***************************************************************************************
+** Function name:           queueFillRect
+** Description:             queue a filled rectangle to be drawn by runQueue()
+***************************************************************************************/
+boolean TFT_ST7735::queueFillRect(int16_t x, int16_t y, int16_t w, int16_t h, uint16_t color)
+{
+  if (!h) return true;
+  tftqueueop op = { (uint8_t)x, (uint8_t)y, (uint8_t)w, (uint8_t)h, color, 0 };
+  return enqueue(op);
+}
+
+/***************************************************************************************
+** Function name:           queueChar
+** Description:             queue a GLCD font character to be drawn by runQueue()
+***************************************************************************************/
+boolean TFT_ST7735::queueChar(int16_t x, int16_t y, unsigned char c, uint16_t color, uint16_t bg)
+{
+  tftqueueop op = { (uint8_t)x, (uint8_t)y, c, 0, color, bg };
+  return enqueue(op);
+}
+
+/***************************************************************************************
+** Function name:           queueScroll
+** Description:             queue a scrollTo(), so it happens in order with the drawing
+***************************************************************************************/
+boolean TFT_ST7735::queueScroll(uint8_t offset)
+{
+  tftqueueop op = { 0, offset, 0, TFT_QUEUE_SCROLL, 0, 0 };
+  return enqueue(op);
+}
+
+/***************************************************************************************
+** Function name:           queueTile
+** Description:             queue a drawTile() to be drawn by runQueue()
+***************************************************************************************/
+boolean TFT_ST7735::queueTile(int16_t x, int16_t y, uint8_t tile)
+{
+  tftqueueop op = { (uint8_t)x, (uint8_t)y, tile, TFT_QUEUE_TILE, 0, 0 };
+  return enqueue(op);
+}
+
+/***************************************************************************************
+** Function name:           queueCells
+** Description:             queue a row of up to 8 cells, to be drawn by runQueue()
+***************************************************************************************/
+boolean TFT_ST7735::queueCells(int16_t x, int16_t y, uint8_t pitch, uint8_t size,
+                               uint16_t bits, uint16_t changed)
+{
+  if (!changed) return true;
+  tftqueueop op = { (uint8_t)x, (uint8_t)y, size, TFT_QUEUE_CELLS, bits, changed, pitch };
+  return enqueue(op);
+}
+
+/***************************************************************************************
+** Function name:           queued
+** Description:             return the number of operations waiting in the queue
+***************************************************************************************/
+uint8_t TFT_ST7735::queued(void)
+{
+  return (queueHead - queueTail) & (TFT_QUEUE_SIZE - 1);
+}
+
+/***************************************************************************************
+** Function name:           runQueue
+** Description:             draw up to maxOps queued operations in a single burst
+***************************************************************************************/
+// Intended to be called from a timer interrupt, so that a limited amount of
+// drawing is done each tick while the main code carries on. A row of cells
+// which can't all be drawn this time is left at the front of the queue, with
+// the cells which have been drawn taken out of it, and finished next time.
+
+void TFT_ST7735::runQueue(uint8_t maxCells)
+{
+  if (queueTail == queueHead) return;
+
+  beginBurst();
+  while (maxCells && queueTail != queueHead) {
+    tftqueueop *op = &queue[queueTail];
+    if (op->h == TFT_QUEUE_CELLS) {
+      // only this side touches the op until it's taken off the queue
+      boolean tiles = tileSheet && op->w == TFT_TILESIZE;
+      while (maxCells && op->bg) {
+        if (op->bg & 3) {
+          if (tiles)
+            drawTile(op->x, op->y, op->color & 3);
+          else
+            fillRect(op->x, op->y, op->w, op->w, cellColours[op->color & 3]);
+          maxCells--;
+        }
+        op->x += op->pitch;
+        op->color >>= 2;
+        op->bg >>= 2;
+      }
+      if (op->bg) break; // the rest of the row next time
+    }
+    else {
+      maxCells--;
+      if (op->h == TFT_QUEUE_SCROLL)
+        scrollTo(op->y);
+      else if (op->h == TFT_QUEUE_TILE)
+        drawTile(op->x, op->y, op->w);
+      else if (op->h)
+        fillRect(op->x, op->y, op->w, op->h, op->color);
+      else
+        drawChar(op->x, op->y, op->w, op->color, op->bg, 1);
+    }
+    queueTail = (queueTail + 1) & (TFT_QUEUE_SIZE - 1);
+  }
+  endBurst();
 }
 
 /***************************************************************************************
@@ -1605,6 +1811,41 @@ void TFT_ST7735::invertDisplay(boolean i)
   spi_end();
 }
 
+/***************************************************************************************
+** Function name:           setScrollArea
+** Description:             define the area which scrollTo() moves, in frame memory lines
+***************************************************************************************/
+void TFT_ST7735::setScrollArea(uint16_t top, uint16_t lines)
+{
+  // the panel's first line may not be the first line of memory
+  top += rowstart;
+  if (top + lines > ST7735_MEMHEIGHT) lines = ST7735_MEMHEIGHT - top;
+  uint16_t bottom = ST7735_MEMHEIGHT - top - lines;
+  scrollTop = top;
+
+  beginBurst();
+  writecommand(ST7735_VSCRDEF);
+  writedata(top >> 8);    writedata(top);    // top fixed area
+  writedata(lines >> 8);  writedata(lines);  // scrolling area
+  writedata(bottom >> 8); writedata(bottom); // bottom fixed area
+  endBurst();
+}
+
+/***************************************************************************************
+** Function name:           scrollTo
+** Description:             show the scrolling area moved up by offset lines
+***************************************************************************************/
+void TFT_ST7735::scrollTo(uint16_t offset)
+{
+  // this is the line of memory which appears at the top of the scrolling area
+  uint16_t start = scrollTop + offset;
+
+  beginBurst();
+  writecommand(ST7735_VSCRSADD);
+  writedata(start >> 8); writedata(start);
+  endBurst();
+}
+
 /***************************************************************************************
 ** Function name:           write
 ** Description:             draw characters piped through serial stream
@@ -2336,4 +2577,4 @@ inline void spiWait12(void)
   Written by Limor Fried/Ladyada for Adafruit Industries.
   MIT license, all text above must be included in any redistribution
 
- ****************************************************/
\ No newline at end of file
+ ****************************************************/
\ No newline at end of file
@@ -110,6 +110,10 @@ tftswap(T& a, T& b) { T t = a; a = b; b = t; }
 #define ST7735_TFTWIDTH  128
 #define ST7735_TFTHEIGHT 160
 
+// Lines of frame memory, whether or not the panel shows them all - the
+// scrolling commands work in these
+#define ST7735_MEMHEIGHT 162
+
 #define ST7735_NOP     0x00
 #define ST7735_SWRESET 0x01
 #define ST7735_RDDID   0x04
@@ -130,8 +134,10 @@ tftswap(T& a, T& b) { T t = a; a = b; b = t; }
 #define ST7735_RAMRD   0x2E
 
 #define ST7735_PTLAR   0x30
+#define ST7735_VSCRDEF 0x33
 #define ST7735_COLMOD  0x3A
 #define ST7735_MADCTL  0x36
+#define ST7735_VSCRSADD 0x37
 
 #define ST7735_FRMCTR1 0xB1
 #define ST7735_FRMCTR2 0xB2
@@ -207,6 +213,28 @@ tftswap(T& a, T& b) { T t = a; a = b; b = t; }
 #define ST7735_GREENYELLOW 0xAFE5      /* 173, 255,  47 */
 #define ST7735_PINK        0xF81F
 
+// Tiles for drawTile() are TFT_TILESIZE pixels square, with 2 bits a pixel
+// packed four to a byte, first pixel in the lowest bits, row after row - so
+// TFT_TILEBYTES bytes each. Each 2 bit value picks one of 4 colours from the
+// tile's own palette.
+#define TFT_TILESIZE  12
+#define TFT_TILEBYTES (TFT_TILESIZE * TFT_TILESIZE / 4)
+
+// A drawing operation waiting in the queue, see queueFillRect(), queueChar(),
+// queueScroll(), queueTile() and queueCells(). A character is stored with h = 0
+// and the character code in w, a scroll with h = TFT_QUEUE_SCROLL and the offset
+// in y, a tile with h = TFT_QUEUE_TILE and the tile number in w, and a row of
+// cells with h = TFT_QUEUE_CELLS, the cell size in w, the cells in color and
+// which of them to draw in bg.
+#define TFT_QUEUE_SCROLL 0xFF
+#define TFT_QUEUE_TILE   0xFE
+#define TFT_QUEUE_CELLS  0xFD
+typedef struct {
+  uint8_t  x, y, w, h;
+  uint16_t color, bg;
+  uint8_t  pitch; // for a row of cells
+  } tftqueueop;
+
 typedef struct {
 	const unsigned char *chartbl;
 	const unsigned char *widthtbl;
@@ -283,6 +311,13 @@ class TFT_ST7735 : public Print {
            backupSPCR(void),
            restoreSPCR(void),
 
+           beginBurst(void),
+           endBurst(void),
+
+           // draws up to maxCells queued operations, counting each cell of a
+           // queueCells() row as one
+           runQueue(uint8_t maxCells),
+
            drawLine(int16_t x0, int16_t y0, int16_t x1, int16_t y1, uint16_t color),
            drawFastVLine(int16_t x, int16_t y, int16_t h, uint16_t color),
            drawFastHLine(int16_t x, int16_t y, int16_t w, uint16_t color),
@@ -295,6 +330,23 @@ class TFT_ST7735 : public Print {
            setRotation(uint8_t r),
            invertDisplay(boolean i),
 
+           // Hardware vertical scrolling: lines top to top+lines-1 of the frame memory
+           // become the scrolling area, the rest stay put. scrollTo(n) then shows the
+           // area as if its contents had moved up by n lines, wrapping round, without
+           // redrawing anything. Lines are screen rows in rotation 2, are counted from
+           // the bottom in rotation 0, and are columns in the landscape rotations.
+           setScrollArea(uint16_t top, uint16_t lines),
+           scrollTo(uint16_t offset),
+
+           // Tiles: sheet is in PROGMEM and holds TFT_TILEBYTES for each tile,
+           // palettes is in RAM and holds 4 colours for each tile. Both are
+           // used in place, so must stay around while tiles are drawn.
+           setTiles(const uint8_t *sheet, const uint16_t *palettes),
+           drawTile(int16_t x, int16_t y, uint8_t tile),
+           // the 4 colours queueCells() fills its cells with, when they aren't
+           // tiles - used in place, like the palettes
+           setCellColours(const uint16_t *colours),
+
            drawCircle(int16_t x0, int16_t y0, int16_t r, uint16_t color),
            drawCircleHelper(int16_t x0, int16_t y0, int16_t r, uint8_t cornername, uint16_t color),
            fillCircle(int16_t x0, int16_t y0, int16_t r, uint16_t color),
@@ -323,7 +375,24 @@ class TFT_ST7735 : public Print {
            writedata(uint8_t d),
            commandList(const uint8_t *addr);
 
-  uint8_t  getRotation(void);
+  uint8_t  getRotation(void),
+           queued(void);
+
+  // Add operations to the queue, to be drawn later by runQueue(). These return
+  // false if the queue is full. They may be called while runQueue() is running
+  // in an interrupt, provided that nothing else adds to the queue at the same time.
+  boolean  queueFillRect(int16_t x, int16_t y, int16_t w, int16_t h, uint16_t color),
+           queueChar(int16_t x, int16_t y, unsigned char c, uint16_t color, uint16_t bg),
+           queueScroll(uint8_t offset),
+           queueTile(int16_t x, int16_t y, uint8_t tile),
+           // up to 8 cells in a single operation: bits holds 2 bits per cell,
+           // the first cell in the lowest bits, and each cell with either of
+           // its bits set in changed is drawn as a size x size square at (x, y),
+           // moving on by pitch for each cell. A square is a tile if there is
+           // a tile sheet and size is TFT_TILESIZE, and filled with one of the
+           // setCellColours() colours if not.
+           queueCells(int16_t x, int16_t y, uint8_t pitch, uint8_t size,
+                      uint16_t bits, uint16_t changed);
 
   uint16_t fontsLoaded(void),
            color565(uint8_t r, uint8_t g, uint8_t b);
@@ -350,10 +419,23 @@ class TFT_ST7735 : public Print {
   uint8_t  tabcolor,
            colstart, rowstart; // some displays need this changed
 
+  uint8_t  scrollTop; // the first line of the scrolling area in frame memory
+
+  const uint8_t  *tileSheet;    // PROGMEM, see setTiles()
+  const uint16_t *tilePalettes;
+  const uint16_t *cellColours;  // see setCellColours()
+
   boolean  hwSPI;
 
   uint8_t  mySPCR, savedSPCR;
 
+  uint8_t  burstDepth; // nesting count for beginBurst()/endBurst()
+
+  tftqueueop queue[TFT_QUEUE_SIZE];
+  volatile uint8_t queueHead, queueTail; // written by the queue*() and runQueue() sides respectively
+
+  boolean  enqueue(const tftqueueop &op);
+
   int8_t   _cs, _dc, _rst, _mosi, _miso, _sclk;
 
 
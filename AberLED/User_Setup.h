@@ -88,3 +88,17 @@
 
 // #define SUPPORT_TRANSACTIONS
 
+// ##################################################################################
+//
+// Drawing queue
+//
+// ##################################################################################
+
+// Number of operations the queue*() functions can hold before they must be drawn
+// by runQueue(). Each one takes 9 bytes of RAM. Must be a power of 2. AberLED's
+// AF_ASYNCTFT queues each changed row of the 8x8 grid as one operation, so 16
+// (144 bytes) takes a whole frame, a scroll and a few characters of text or HUD
+// without swap() having to wait for room.
+
+#define TFT_QUEUE_SIZE 16
+
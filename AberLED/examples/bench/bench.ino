@@ -0,0 +1,308 @@
+/**
+ * @file bench.ino
+ * @brief Times the AberLED and TFT primitives and prints a table over Serial
+ * (115200 baud).
+ *
+ * Each test is run ITERATIONS times twice: once with the interrupts running
+ * as normal, timed with micros(), and once with interrupts off, when each
+ * iteration is timed with Timer1 (borrowed from AberLED for the purpose) so
+ * we can also see the best case. Times are the average per iteration - the
+ * "irq off" column gives CPU cycles, accurate to about 8. A "-" means the
+ * test doesn't make sense that way, such as a waiting swap() with no
+ * interrupt to wait for. At the end it prints AberLED.memoryReport(), where
+ * the statistics are 0 unless ABERLED_STATS is set to 1 in AberLED_Setup.h
+ * (this bench doesn't need them - it does its own timing).
+ *
+ * Set BENCH_LED to 1 to run on a bicolor LED board rather than a TFT (this is
+ * done for you if ABERLED_DISPLAY in AberLED_Setup.h only has the LED code).
+ * The TFT tests are skipped on an LED board, and the shift register test on a
+ * TFT board (which uses the same pins for something else).
+ */
+
+#include <AberLED.h>
+
+#if ABERLED_DISPLAY == ABERLED_LED
+#define BENCH_LED 1
+#else
+#define BENCH_LED 0
+#endif
+
+#define ITERATIONS 100
+
+// the TFT, and the shift register routine, inside AberLED.cpp - if they
+// have been compiled in
+#if ABERLED_DISPLAY != ABERLED_LED
+#include <TFT_ST7735.h>
+extern TFT_ST7735 tft;
+#endif
+#if ABERLED_DISPLAY != ABERLED_TFT
+extern void fastShiftOutCols(uint16_t n);
+#endif
+
+// the iteration we're on, so tests can change what they do each time
+static uint16_t iter;
+
+/*
+ * The tests
+ */
+
+static void testNothing() {
+}
+
+static void testSet() {
+    AberLED.set(iter & 7, (iter >> 3) & 7, GREEN);
+}
+
+static void testSetFast() {
+    AberLED.setFast(iter & 7, (iter >> 3) & 7, GREEN);
+}
+
+static void testBuffer() {
+    uint16_t *p = AberLED.getBuffer() + ((iter >> 3) & 7);
+    int x = (iter & 7) * 2;
+    *p = (*p & ~(3u << x)) | ((uint16_t)GREEN << x);
+}
+
+static void testClear() {
+    AberLED.clear();
+}
+
+static void testSwap() {
+    // change a pixel so there's something to draw
+    AberLED.set(iter & 7, (iter >> 3) & 7, iter & 3);
+    AberLED.swap();
+}
+
+static void testSwapAsync() {
+    AberLED.set(iter & 7, (iter >> 3) & 7, iter & 3);
+    AberLED.swapAsync();
+}
+
+static void testRefresh() {
+    AberLED.set(iter & 7, (iter >> 3) & 7, iter & 3);
+    AberLED.swapAsync();
+    AberLED.refresh();
+}
+
+#if ABERLED_DISPLAY != ABERLED_LED
+static void testFillRect() {
+    tft.fillRect(16 * (iter & 7) + 2, 16 * ((iter >> 3) & 7) + 2, 12, 12,
+                 iter & 1 ? TFT_GREEN : TFT_BLACK);
+}
+
+static void testDrawChar() {
+    tft.drawChar(4 + 6 * (iter & 15), 150, 'A' + (iter & 15), TFT_WHITE, TFT_BLACK, 1);
+}
+
+static void testPushColor() {
+    // a whole cell's worth of pixels
+    tft.setAddrWindow(2, 2, 13, 13);
+    tft.pushColor(iter & 1 ? TFT_GREEN : TFT_BLACK, 144);
+}
+
+#endif
+
+#if ABERLED_DISPLAY != ABERLED_TFT
+static void testShiftOut() {
+    fastShiftOutCols(iter);
+}
+#endif
+
+// when each test can be run
+#define T_TFT 1      // only on a TFT
+#define T_LED 2      // only on an LED board
+#define T_IRQON 4    // with interrupts on
+#define T_IRQOFF 8   // with interrupts off
+#define T_BOTH (T_IRQON | T_IRQOFF)
+
+// The table and the names are kept in flash, like the other constant strings
+// (with F()), so they don't take up RAM; a Test is copied out with memcpy_P()
+// and its name printed as a flash string.
+struct Test {
+    const char *name; // in PROGMEM
+    void (*fn)();
+    byte flags;
+};
+
+static const char nameSet[] PROGMEM = "set()";
+static const char nameSetFast[] PROGMEM = "setFast()";
+static const char nameBuffer[] PROGMEM = "getBuffer() write";
+static const char nameClear[] PROGMEM = "clear()";
+static const char nameSwap[] PROGMEM = "swap()";
+static const char nameSwapAsync[] PROGMEM = "swapAsync()";
+static const char nameRefresh[] PROGMEM = "refresh()";
+#if ABERLED_DISPLAY != ABERLED_LED
+static const char nameFillRect[] PROGMEM = "fillRect() 12x12";
+static const char nameDrawChar[] PROGMEM = "drawChar()";
+static const char namePushColor[] PROGMEM = "pushColor() 144";
+#endif
+#if ABERLED_DISPLAY != ABERLED_TFT
+static const char nameShiftOut[] PROGMEM = "fastShiftOutCols()";
+#endif
+
+static const Test tests[] PROGMEM = {
+    {nameSet, testSet, T_TFT | T_LED | T_BOTH},
+    {nameSetFast, testSetFast, T_TFT | T_LED | T_BOTH},
+    {nameBuffer, testBuffer, T_TFT | T_LED | T_BOTH},
+    {nameClear, testClear, T_TFT | T_LED | T_BOTH},
+    {nameSwap, testSwap, T_TFT | T_LED | T_IRQON},
+    {nameSwapAsync, testSwapAsync, T_TFT | T_LED | T_BOTH},
+    {nameRefresh, testRefresh, T_TFT | T_LED | T_IRQOFF},
+#if ABERLED_DISPLAY != ABERLED_LED
+    {nameFillRect, testFillRect, T_TFT | T_BOTH},
+    {nameDrawChar, testDrawChar, T_TFT | T_BOTH},
+    {namePushColor, testPushColor, T_TFT | T_BOTH},
+#endif
+#if ABERLED_DISPLAY != ABERLED_TFT
+    {nameShiftOut, testShiftOut, T_LED | T_BOTH},
+#endif
+};
+
+#define NUMTESTS (sizeof(tests) / sizeof(tests[0]))
+
+/*
+ * Timing
+ */
+
+// the average time of an iteration in microseconds, with the interrupts running
+static float timeWithInterrupts(void (*fn)()) {
+    // let the interrupt finish drawing anything left over from the last test,
+    // so it doesn't use the TFT at the same time as this one
+    AberLED.waitForFrame();
+    unsigned long start = micros();
+    for (iter = 0; iter < ITERATIONS; iter++)
+        fn();
+    return (float)(micros() - start) / ITERATIONS;
+}
+
+// the average time of an iteration in cycles, with interrupts off. We take
+// Timer1 over from AberLED and run it at 2MHz (8 cycles a count), timing each
+// iteration separately. This copes with one wrap around of the timer, so
+// iterations must take under 65ms. Tests such as swapAsync() do their own
+// cli() and sei(), so as well as clearing the I flag we mask the interrupts
+// which could otherwise land in the middle - Timer0's (so millis() stands
+// still meanwhile) and the serial port's, which is why Serial is emptied first.
+static float timeWithoutInterrupts(void (*fn)(), uint32_t *best) {
+    Serial.flush();
+    cli();
+    byte savedA = TCCR1A, savedB = TCCR1B, savedMask = TIMSK1;
+    byte savedMask0 = TIMSK0, savedUart = UCSR0B;
+    TIMSK1 = 0;
+    TIMSK0 = 0;
+    UCSR0B = savedUart & ~((1 << RXCIE0) | (1 << TXCIE0) | (1 << UDRIE0));
+    TCCR1A = 0;
+    TCCR1B = 1 << CS11; // normal mode, prescaler 8
+
+    uint32_t total = 0;
+    *best = 0xffffffff;
+    for (iter = 0; iter < ITERATIONS; iter++) {
+        TIFR1 = 1 << TOV1;
+        uint16_t start = TCNT1;
+        fn();
+        uint16_t end = TCNT1;
+        uint32_t t = (uint16_t)(end - start);
+        if ((TIFR1 & (1 << TOV1)) && end >= start)
+            t += 65536;
+        if (t < *best)
+            *best = t;
+        total += t;
+    }
+
+    // put the timer back as AberLED had it
+    TCCR1B = 0;
+    TCNT1 = 0;
+    TCCR1A = savedA;
+    TIFR1 = (1 << OCF1A) | (1 << TOV1);
+    TCCR1B = savedB;
+    TIMSK1 = savedMask;
+    TIMSK0 = savedMask0;
+    UCSR0B = savedUart;
+    sei();
+
+    *best *= 8;
+    return (float)total * 8 / ITERATIONS;
+}
+
+static void printPadded(const __FlashStringHelper *s, int width) {
+    Serial.print(s);
+    for (int i = strlen_P((const char *)s); i < width; i++)
+        Serial.print(' ');
+}
+
+static void printPadded(float f, int width) {
+    char buf[16];
+    dtostrf(f, width, 1, buf);
+    Serial.print(buf);
+}
+
+void setup() {
+    Serial.begin(115200);
+#if BENCH_LED
+    AberLED.begin(AF_LEDDISPLAY);
+    byte board = T_LED;
+#else
+    AberLED.begin();
+    byte board = T_TFT;
+#endif
+
+    Serial.print(F("AberLED "));
+    Serial.print(AberLED.version());
+    Serial.print(F(", "));
+    Serial.print(ITERATIONS);
+    Serial.println(F(" iterations"));
+    Serial.println(F("test                    irq on (us)  irq off (cycles)  best (cycles)"));
+
+    // measure the cost of the timing itself, to take it off the rest
+    uint32_t best;
+    float overheadUs = timeWithInterrupts(testNothing);
+    float overheadCycles = timeWithoutInterrupts(testNothing, &best);
+
+    for (unsigned int i = 0; i < NUMTESTS; i++) {
+        Test t;
+        memcpy_P(&t, tests + i, sizeof(t));
+        if (!(t.flags & board))
+            continue;
+        printPadded((const __FlashStringHelper *)t.name, 24);
+
+        if (t.flags & T_IRQON)
+            printPadded(timeWithInterrupts(t.fn) - overheadUs, 11);
+        else
+            printPadded(F("          -"), 11);
+
+        if (t.flags & T_IRQOFF) {
+            printPadded(timeWithoutInterrupts(t.fn, &best) - overheadCycles, 18);
+            printPadded(best - overheadCycles, 15);
+        } else {
+            printPadded(F("                 -"), 18);
+            printPadded(F("              -"), 15);
+        }
+        Serial.println();
+    }
+
+    AberLEDMemory mem;
+    AberLED.memoryReport(&mem);
+    Serial.print(F("RAM free "));
+    Serial.print(mem.freeNow);
+    Serial.print(F(", least free "));
+    Serial.print(mem.freeLow);
+    Serial.print(F(", static "));
+    Serial.println(mem.staticData);
+    Serial.print(F("buffers: frame "));
+    Serial.print(mem.frameBuffers);
+    Serial.print(F(", text "));
+    Serial.print(mem.text);
+    Serial.print(F(", input "));
+    Serial.print(mem.input);
+    Serial.print(F(", tft "));
+    Serial.print(mem.tft);
+    Serial.print(F(", trace "));
+    Serial.print(mem.trace);
+    Serial.print(F(", stats "));
+    Serial.print(mem.stats);
+    Serial.print(F(", tasks "));
+    Serial.println(mem.tasks);
+    Serial.println(F("done"));
+}
+
+void loop() {
+}
@@ -0,0 +1,28 @@
+// Things shared by AberLED.cpp and the host driver when AberLED is built
+// with ABERLED_HOST set, to run on a desktop machine instead of the board.
+// The display is just the hostFrame array, which the interrupt fills in.
+#ifndef __ABERLED_HOST_H
+#define __ABERLED_HOST_H
+
+#include "Arduino.h"
+
+// what is on the "display" - the interrupt copies each row of the front
+// buffer into this, as it would send it to the LED matrix
+extern uint16_t hostFrame[8];
+
+// the virtual clock, in microseconds
+extern unsigned long long hostMicros;
+
+// the length of an interrupt tick (the LED display's 500Hz)
+#define HOST_TICK_US 2000
+
+// move the clock on by one tick, running the interrupt if it is enabled. AberLED's
+// wait loops call this, because there is nothing else to run the interrupt.
+void hostTick();
+
+// if set, called by hostTick() before the interrupt - the driver uses this to
+// press a script's buttons on time, even while the sketch sleeps through
+// several ticks in one frame
+extern void (*hostTickHook)();
+
+#endif
@@ -0,0 +1,81 @@
+// Host stand-in for Arduino.h, so that AberLED and a sketch can be built
+// and run on a desktop machine - see Makefile. Time is virtual: it only
+// moves on when the interrupt ticks (see hostTick()) or delay() is called,
+// so a run is exactly repeatable and goes as fast as the machine can.
+#ifndef __HOST_ARDUINO_H
+#define __HOST_ARDUINO_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "avr/io.h"
+#include "avr/interrupt.h"
+#include "avr/pgmspace.h"
+#include "Print.h"
+#include "Stream.h"
+
+typedef uint8_t byte;
+typedef bool boolean;
+typedef uint16_t word;
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+#define A0 14
+#define A1 15
+#define A2 16
+#define A3 17
+#define A4 18
+#define A5 19
+
+#ifndef min
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
+#endif
+#define constrain(x, lo, hi) ((x) < (lo) ? (lo) : ((x) > (hi) ? (hi) : (x)))
+
+#define F(s) ((const __FlashStringHelper *)(s))
+
+inline void pinMode(uint8_t, uint8_t) {}
+inline void digitalWrite(uint8_t, uint8_t) {}
+inline int analogRead(uint8_t) { return 0; }
+
+// Uno pin numbers to ports (B=2, C=3, D=4) and bits, for the slower pin
+// classes in TFT_FastPin.h
+inline uint8_t digitalPinToPort(uint8_t pin) { return pin < 8 ? 4 : pin < 14 ? 2 : 3; }
+inline uint8_t digitalPinToBitMask(uint8_t pin) { return 1 << (pin < 8 ? pin : pin < 14 ? pin - 8 : pin - 14); }
+inline volatile uint8_t *portOutputRegister(uint8_t port)
+{
+    return port == 2 ? &PORTB : port == 3 ? &PORTC : &PORTD;
+}
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+
+// these give the same numbers as avr-libc does, so a seed does the
+// same thing here as on the board
+long random(long howbig);
+long random(long howsmall, long howbig);
+void randomSeed(unsigned long seed);
+
+// Serial reads from hostSerialIn and writes to hostSerialOut, if they're set
+class HardwareSerial : public Stream {
+public:
+    void begin(unsigned long) {}
+    int available();
+    int read();
+    int availableForWrite() { return 63; }
+    size_t write(uint8_t c);
+    using Print::write;
+    operator bool() { return true; }
+};
+
+extern HardwareSerial Serial;
+
+#endif
@@ -0,0 +1,30 @@
+// Host stand-in for the Arduino Print class, with just the functions
+// the library and sketch use.
+#ifndef __HOST_PRINT_H
+#define __HOST_PRINT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+class __FlashStringHelper;
+
+class Print {
+public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t c) = 0;
+    size_t write(const uint8_t *buf, size_t n);
+    size_t write(const char *s);
+
+    size_t print(const char *s);
+    size_t print(const __FlashStringHelper *s);
+    size_t print(char c);
+    size_t print(int n);
+    size_t print(unsigned int n);
+    size_t print(long n);
+    size_t print(unsigned long n);
+
+    size_t println();
+    template <class T> size_t println(T v) { return print(v) + println(); }
+};
+
+#endif
@@ -0,0 +1,13 @@
+// Host stand-in for the Arduino Stream class.
+#ifndef __HOST_STREAM_H
+#define __HOST_STREAM_H
+
+#include "Print.h"
+
+class Stream : public Print {
+public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+};
+
+#endif
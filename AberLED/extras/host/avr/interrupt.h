@@ -0,0 +1,13 @@
+// Host stand-in for <avr/interrupt.h>. Interrupt handlers become ordinary
+// functions, which hostTick() calls, so there is nothing to disable.
+#ifndef __HOST_AVR_INTERRUPT_H
+#define __HOST_AVR_INTERRUPT_H
+
+#define ISR(vector) extern "C" void vector(void)
+
+inline void cli() {}
+inline void sei() {}
+
+extern "C" void TIMER1_COMPA_vect(void);
+
+#endif
@@ -0,0 +1,23 @@
+// Host stand-in for <avr/io.h>: the registers AberLED uses are plain
+// variables, defined in host.cpp. The host driver sets PINB and PINC
+// to simulate the buttons.
+#ifndef __HOST_AVR_IO_H
+#define __HOST_AVR_IO_H
+
+#include <stdint.h>
+
+extern volatile uint8_t PORTB, PORTC, PORTD, DDRB, DDRC, DDRD, PINB, PINC, PIND;
+extern volatile uint8_t TCCR1A, TCCR1B, TIMSK1, TIFR1, SREG;
+extern volatile uint16_t OCR1A, OCR1B, TCNT1;
+
+#define _BV(b) (1 << (b))
+#define CS10 0
+#define CS11 1
+#define CS12 2
+#define WGM12 3
+#define SREG_I 7
+#define OCIE1A 1
+#define OCIE1B 2
+#define OCF1B 2
+
+#endif
@@ -0,0 +1,173 @@
+// The parts of the Arduino core which the library and sketch need,
+// for running on a desktop machine. See Arduino.h.
+
+#include "AberLED_Host.h"
+
+volatile uint8_t PORTB, PORTC, PORTD, DDRB, DDRC, DDRD, PINB, PINC, PIND;
+volatile uint8_t TCCR1A, TCCR1B, TIMSK1, TIFR1, SREG;
+volatile uint16_t OCR1A, OCR1B, TCNT1;
+
+unsigned long long hostMicros = 0;
+void (*hostTickHook)() = NULL;
+
+void hostTick()
+{
+    hostMicros += HOST_TICK_US;
+    if (hostTickHook)
+        hostTickHook();
+    if (TIMSK1 & (1 << OCIE1A))
+        TIMER1_COMPA_vect();
+}
+
+unsigned long millis()
+{
+    return hostMicros / 1000;
+}
+
+unsigned long micros()
+{
+    return hostMicros;
+}
+
+void delay(unsigned long ms)
+{
+    // keep the interrupt running while we wait, as it would on the board
+    unsigned long long end = hostMicros + ms * 1000ULL;
+    while (hostMicros + HOST_TICK_US <= end)
+        hostTick();
+    hostMicros = end;
+}
+
+void delayMicroseconds(unsigned int us)
+{
+    hostMicros += us;
+}
+
+// avr-libc's random(), the "minimal standard" generator
+static int32_t randomState = 1;
+
+static int32_t nextRandom()
+{
+    int32_t x = randomState;
+    if (x == 0)
+        x = 123459876L;
+    int32_t hi = x / 127773L;
+    int32_t lo = x % 127773L;
+    x = 16807L * lo - 2836L * hi;
+    if (x < 0)
+        x += 0x7fffffffL;
+    randomState = x;
+    return x;
+}
+
+long random(long howbig)
+{
+    if (howbig == 0)
+        return 0;
+    return nextRandom() % howbig;
+}
+
+long random(long howsmall, long howbig)
+{
+    if (howsmall >= howbig)
+        return howsmall;
+    return random(howbig - howsmall) + howsmall;
+}
+
+void randomSeed(unsigned long seed)
+{
+    if (seed != 0)
+        randomState = seed;
+}
+
+// Serial output goes to this file and input comes from this one, if they're
+// set (see -o and -r in main.cpp)
+FILE *hostSerialOut = NULL;
+FILE *hostSerialIn = NULL;
+HardwareSerial Serial;
+
+int HardwareSerial::available()
+{
+    if (!hostSerialIn)
+        return 0;
+    int c = getc(hostSerialIn);
+    if (c == EOF)
+    {
+        // a pipe may have more later (see -r in main.cpp)
+        clearerr(hostSerialIn);
+        return 0;
+    }
+    ungetc(c, hostSerialIn);
+    return 1;
+}
+
+int HardwareSerial::read()
+{
+    if (!hostSerialIn)
+        return -1;
+    int c = getc(hostSerialIn);
+    return c == EOF ? -1 : c;
+}
+
+size_t HardwareSerial::write(uint8_t c)
+{
+    if (hostSerialOut)
+        fputc(c, hostSerialOut);
+    return 1;
+}
+
+size_t Print::write(const uint8_t *buf, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+        write(buf[i]);
+    return n;
+}
+
+size_t Print::write(const char *s)
+{
+    return write((const uint8_t *)s, strlen(s));
+}
+
+size_t Print::print(const char *s)
+{
+    return write(s);
+}
+
+size_t Print::print(const __FlashStringHelper *s)
+{
+    return write((const char *)s);
+}
+
+size_t Print::print(char c)
+{
+    return write((uint8_t)c);
+}
+
+size_t Print::print(int n)
+{
+    return print((long)n);
+}
+
+size_t Print::print(unsigned int n)
+{
+    return print((unsigned long)n);
+}
+
+size_t Print::print(long n)
+{
+    char buf[24];
+    snprintf(buf, sizeof(buf), "%ld", n);
+    return write(buf);
+}
+
+size_t Print::print(unsigned long n)
+{
+    char buf[24];
+    snprintf(buf, sizeof(buf), "%lu", n);
+    return write(buf);
+}
+
+size_t Print::println()
+{
+    return write("\r\n");
+}
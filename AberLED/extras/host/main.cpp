@@ -0,0 +1,268 @@
+// A driver which runs a sketch on a desktop machine: it calls setup(), then
+// loop() over and over, pressing the buttons as told, as fast as it can.
+//
+//   aberled-host [-n frames] [-s seed] [-i script] [-z] [-p every] [-o file]
+//                [-r file] [-t speed] [-q]
+//
+//   -n  how many times to call loop() (default 100000)
+//   -s  call randomSeed() with this before setup()
+//   -i  read button presses from a script. Each line is a time in milliseconds
+//       and the buttons held from then on, as letters from UDLRF, or - for none:
+//           1000 F
+//           1100 -
+//   -z  press buttons at random (a 'fuzz' test)
+//   -p  print the display every so many frames
+//   -o  write anything the sketch sends to Serial to this file (such as the
+//       trace log - see ../tracedecode.py)
+//   -r  make Serial read from this file - for example a recording for the
+//       sketch to replay, if it was built with RECORDMODE=2
+//   -t  run this many times faster than real time, rather than flat out
+//   -q  don't print the summary at the end
+//
+// The files for -o and -r can be named pipes, so that two runs can talk to
+// each other like two boards with their serial ports linked - for 6.ino's
+// versus mode, say. Use -t so that neither gets too far ahead of the other:
+//   mkfifo ab ba
+//   ./aberled-host -z -s 1 -t 10 -o ab -r ba &
+//   ./aberled-host -z -s 2 -t 10 -r ab -o ba
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "AberLED_Host.h"
+#include "AberLED.h"
+
+extern FILE *hostSerialOut, *hostSerialIn;
+
+void setup();
+void loop();
+
+// the letters for UP, DOWN, LEFT, RIGHT and FIRE in scripts. The button
+// masks have button n on bit n-1, like AberLED's own.
+static const char buttonLetters[] = "UDLRF";
+
+// simulate the buttons by setting the pins they're connected to - these are
+// the bits for the REV01 board, see AberLEDClass::setRevision()
+static void setButtons(uint8_t mask)
+{
+    static const uint8_t pinBits[5] = {1, 8, 4, 2, 16};
+    uint8_t pins = 0x1f; // the buttons pull the pins low when pressed
+    for (int i = 0; i < 5; i++)
+    {
+        if (mask & (1 << i))
+            pins &= ~pinBits[i];
+    }
+    PINC = pins & 0x0f;
+    PINB = (pins >> 3) & 2;
+}
+
+// turn letters into a button mask
+static uint8_t parseButtons(const char *s)
+{
+    int codes[5] = {UP, DOWN, LEFT, RIGHT, FIRE};
+    uint8_t mask = 0;
+    for (; *s; s++)
+    {
+        const char *p = strchr(buttonLetters, *s);
+        if (p)
+            mask |= 1 << (codes[p - buttonLetters] - 1);
+    }
+    return mask;
+}
+
+struct ScriptLine {
+    unsigned long time;
+    uint8_t buttons;
+};
+
+static ScriptLine *script = NULL;
+static int scriptLen = 0;
+static int scriptPos = 0;
+
+// press the buttons for any script lines which have come due
+static void runScript()
+{
+    if (scriptPos < scriptLen && script[scriptPos].time <= millis())
+    {
+        while (scriptPos < scriptLen && script[scriptPos].time <= millis())
+            scriptPos++;
+        setButtons(script[scriptPos - 1].buttons);
+    }
+}
+
+static void readScript(const char *name)
+{
+    FILE *f = fopen(name, "r");
+    if (!f)
+    {
+        perror(name);
+        exit(1);
+    }
+    char line[128], buttons[64];
+    unsigned long t;
+    int size = 0;
+    while (fgets(line, sizeof(line), f))
+    {
+        if (sscanf(line, "%lu %63s", &t, buttons) != 2)
+            continue;
+        if (scriptLen == size)
+        {
+            size = size ? size * 2 : 64;
+            script = (ScriptLine *)realloc(script, size * sizeof(ScriptLine));
+        }
+        script[scriptLen].time = t;
+        script[scriptLen].buttons = parseButtons(buttons);
+        scriptLen++;
+    }
+    fclose(f);
+}
+
+// a pipe to another run shouldn't hold anything back, or wait when there's
+// nothing to read
+static void setUpPipe(FILE *f, bool input)
+{
+    struct stat st;
+    if (fstat(fileno(f), &st) || !S_ISFIFO(st.st_mode))
+        return;
+    setvbuf(f, NULL, _IONBF, 0);
+    if (input)
+        fcntl(fileno(f), F_SETFL, fcntl(fileno(f), F_GETFL) | O_NONBLOCK);
+}
+
+static double realSeconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void printDisplay(unsigned long frame)
+{
+    static const char pixels[] = ".GRY";
+    printf("frame %lu, %lums\n", frame, millis());
+    for (int y = 0; y < 8; y++)
+    {
+        for (int x = 0; x < 8; x++)
+            putchar(pixels[(hostFrame[y] >> (x * 2)) & 3]);
+        putchar('\n');
+    }
+}
+
+int main(int argc, char **argv)
+{
+    unsigned long frames = 100000, printEvery = 0, seed = 0;
+    double speed = 0;
+    bool fuzz = false, quiet = false;
+    const char *scriptName = NULL;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:s:i:zp:o:r:t:q")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n': frames = strtoul(optarg, NULL, 0); break;
+        case 's': seed = strtoul(optarg, NULL, 0); break;
+        case 'i': scriptName = optarg; break;
+        case 'z': fuzz = true; break;
+        case 'p': printEvery = strtoul(optarg, NULL, 0); break;
+        case 'o':
+            hostSerialOut = fopen(optarg, "wb");
+            if (!hostSerialOut)
+            {
+                perror(optarg);
+                return 1;
+            }
+            setUpPipe(hostSerialOut, false);
+            break;
+        case 'r':
+            hostSerialIn = fopen(optarg, "rb");
+            if (!hostSerialIn)
+            {
+                perror(optarg);
+                return 1;
+            }
+            setUpPipe(hostSerialIn, true);
+            break;
+        case 't': speed = strtod(optarg, NULL); break;
+        case 'q': quiet = true; break;
+        default:
+            fprintf(stderr, "usage: %s [-n frames] [-s seed] [-i script] [-z] "
+                            "[-p every] [-o file] [-r file] [-t speed] [-q]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+
+    setButtons(0);
+    if (seed)
+        randomSeed(seed);
+    setup();
+    // we need the button codes from setup() to read the script
+    if (scriptName)
+        readScript(scriptName);
+
+    // the fuzzer has its own generator, so it doesn't disturb the sketch's
+    uint32_t fuzzState = seed ? seed : 1;
+    uint8_t buttons = 0;
+    if (scriptName)
+    {
+        setButtons(0);
+        hostTickHook = runScript;
+    }
+
+    clock_t start = clock();
+    unsigned long long startMicros = hostMicros;
+    double realStart = realSeconds();
+
+    for (unsigned long frame = 0; frame < frames; frame++)
+    {
+        if (scriptName)
+            runScript();
+        else
+        {
+            if (fuzz)
+            {
+                // xorshift32; change a button about one frame in eight
+                fuzzState ^= fuzzState << 13;
+                fuzzState ^= fuzzState >> 17;
+                fuzzState ^= fuzzState << 5;
+                if ((fuzzState & 7) == 0)
+                    buttons ^= 1 << ((fuzzState >> 3) % 5);
+            }
+            setButtons(buttons);
+        }
+
+        loop();
+
+        if (printEvery && frame % printEvery == 0)
+            printDisplay(frame);
+
+        if (speed > 0)
+        {
+            // wait for the real world to catch up with the game
+            double ahead = (hostMicros - startMicros) / 1e6 / speed -
+                           (realSeconds() - realStart);
+            if (ahead > 0)
+                usleep(ahead * 1e6);
+        }
+    }
+
+    double secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+    double virtualSecs = (hostMicros - startMicros) / 1e6;
+    unsigned long long ticks = (hostMicros - startMicros) / HOST_TICK_US;
+
+    if (hostSerialOut)
+        fclose(hostSerialOut);
+
+    if (!quiet)
+    {
+        printf("%lu frames, %.1f seconds of game time in %.3f seconds\n",
+               frames, virtualSecs, secs);
+        if (secs > 0)
+            printf("%.0f frames/s, %.0f ticks/s, %.0fx real time\n",
+                   frames / secs, ticks / secs, virtualSecs / secs);
+    }
+    return 0;
+}
@@ -0,0 +1,94 @@
+#!/usr/bin/env python3
+"""
+Decode the binary trace log written by AberLED.trace() and AberLED.flushTrace().
+
+Each record is 6 bytes: 0xa5, the id, the argument, the milliseconds since
+the previous record (16 bits, low byte first), and the exclusive-or of the
+four bytes after the 0xa5. Anything which doesn't look like a record is
+skipped, so it's fine to start reading in the middle of the stream.
+
+Usage:
+    tracedecode.py /dev/ttyACM0 [baud]   (needs pyserial)
+    tracedecode.py capture.bin
+    cat capture.bin | tracedecode.py -
+"""
+
+import sys
+
+SYNC = 0xa5
+
+# names for the ids, and for their arguments where that helps. The ones from
+# 0xf0 up belong to the library, the others to 6.ino - add your own here.
+STATES = {0: "START", 1: "PLAYING", 2: "LIFELOST", 3: "END", 255: "INVALID"}
+BADPLACES = {0: "handleInput", 1: "updateModel", 2: "render"}
+VERSUSENDS = {0: "other board stopped answering", 1: "boards out of step"}
+
+IDS = {
+    1: ("state", lambda a: STATES.get(a, str(a))),
+    2: ("bad state in", lambda a: BADPLACES.get(a, str(a))),
+    3: ("Tetris lines cleared", str),
+    4: ("versus match abandoned:", lambda a: VERSUSENDS.get(a, str(a))),
+    0xf0: ("text changed, length", str),
+    0xf1: ("records lost", str),
+    0xf2: ("seed byte", str),
+    0xf3: ("frame", lambda a: "buttons %s, %d ticks" % (buttons(a & 0x1f), a >> 5)),
+    0xf4: ("long frame, ticks", str),
+}
+
+
+def buttons(mask):
+    """Button numbers 1-5 from a mask, or - if there are none."""
+    return ",".join(str(i + 1) for i in range(5) if mask & (1 << i)) or "-"
+
+
+def records(read):
+    """Yield (id, arg, delta) for each good record from a read(n) function."""
+    buf = b""
+    while True:
+        data = read(64)
+        if not data:
+            return
+        buf += data
+        while len(buf) >= 6:
+            if buf[0] != SYNC:
+                buf = buf[1:]
+                continue
+            _, rid, arg, lo, hi, check = buf[:6]
+            if rid ^ arg ^ lo ^ hi != check:
+                buf = buf[1:]  # not really a record - look for the next sync
+                continue
+            buf = buf[6:]
+            yield rid, arg, lo | (hi << 8)
+
+
+def describe(rid, arg):
+    if rid in IDS:
+        name, fmt = IDS[rid]
+        return "%s %s" % (name, fmt(arg))
+    return "id %d arg %d" % (rid, arg)
+
+
+def main():
+    if len(sys.argv) < 2:
+        print(__doc__)
+        sys.exit(1)
+    name = sys.argv[1]
+    if name == "-":
+        read = sys.stdin.buffer.read1
+    elif name.startswith("/dev/") or name.startswith("COM"):
+        import serial
+        baud = int(sys.argv[2]) if len(sys.argv) > 2 else 115200
+        port = serial.Serial(name, baud, timeout=None)
+        read = lambda n: port.read(1)
+    else:
+        read = open(name, "rb").read
+
+    t = 0
+    for rid, arg, delta in records(read):
+        t += delta
+        print("%10.3f  +%5d  %s" % (t / 1000.0, delta, describe(rid, arg)))
+        sys.stdout.flush()
+
+
+if __name__ == "__main__":
+    main()